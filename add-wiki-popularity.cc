@@ -1,63 +1,154 @@
 #include <algorithm>
+#include <chrono>
+#include <random>
 #include <map>
+#include <memory>
+#include <set>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
 #include <ctype.h>
+#include <fcntl.h>
+#include <inttypes.h>
 #include <math.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "lufz-counts.h"
+#include "lufz-cuckoo.h"
+#include "lufz-ngrams.h"
+#include "lufz-reader.h"
 #include "lufz-util.h"
 
 using namespace std;
 using namespace lufz;
 
-int main(int argc, char* argv[]) {
-  if (argc != 3) {
-    fprintf(stderr, "Usage: %s <Language> <lexicon-file>\n", argv[0]);
-    return 1;
-  }
-  LufzUtil lufz_util(argv[1]);
+namespace {
+const int NGRAM_LIMIT = 6;
 
-  Lexicon lexicon;
-  if (!lufz_util.ReadLexicon(argv[2], &lexicon)) {
-    return 1;
-  }
+/**
+ * The number of lines that each thread counts at a time.
+ */
+const size_t BATCH_LINES = 10000;
 
-  map<string, int> lexicon_index;
-  for (int i = 0; i < lexicon.phrase_infos.size(); ++i) {
-    PhraseInfo& phrase_info = lexicon.phrase_infos[i];
-    lexicon_index[phrase_info.normalized] = i;
-    phrase_info.importance = 1;
-  }
+/**
+ * A chunk of corpus lines, processed by one thread.
+ */
+struct LineBatch {
+  std::vector<std::string> lines;
+  /**
+   * Hit counts by lexicon index. These are not cleared between batches:
+   * each thread keeps adding to its own dense array, and the arrays are
+   * summed up only when the totals are needed (see ReduceCounts()). Left
+   * empty if not needed.
+   */
+  std::vector<uint64_t> counts;
+  /**
+   * If keep_hits is set, lexicon indices of all the n-grams found (with
+   * repetitions), in order.
+   */
+  bool keep_hits;
+  std::vector<int> hits;
+  int64_t num_hits;
+  int64_t num_doc_lines;
+  int64_t num_probes;
+  /**
+   * If discover is set, counts of the 2..NGRAM_LIMIT-grams not in the
+   * lexicon.
+   */
+  bool discover;
+  std::unordered_map<std::string, int64_t> unseen_ngrams;
+  /**
+   * For each "<doc" line, the size of hits at that point.
+   */
+  std::vector<size_t> doc_starts;
+  /**
+   * If cooccur_window > 0, pairs of phrases co-occurring in a line within
+   * that many words (see AddCooccurrences()), split up by
+   * CooccurrenceCounter::ShardGroup() into pairs.size() groups, and both
+   * phrases of each of those pairs (for the marginal counts).
+   */
+  int cooccur_window;
+  std::vector<std::vector<uint64_t>> pairs;
+  std::vector<int> pair_phrases;
+  LineBatch() :
+    keep_hits(false), num_hits(0), num_doc_lines(0), num_probes(0),
+    discover(false), cooccur_window(0) {}
+};
 
-  const int NGRAM_LIMIT = 6;
-  const int BREAK_AFTER_LINES = 30000000;
+/**
+ * Given the phrases found in a line (ids[k] spanning words [spans[k].first,
+ * spans[k].first + spans[k].second), in order of their starts), appends to
+ * batch->pairs each pair of distinct phrases that do not overlap and start
+ * within batch->cooccur_window words of each other (each pair at most once
+ * per line), and appends both phrases of each pair to batch->pair_phrases.
+ */
+void AddCooccurrences(const vector<int>& ids,
+                      const vector<pair<int, int>>& spans,
+                      LineBatch* batch) {
+  vector<uint64_t> line_pairs;
+  for (size_t p = 0; p < ids.size(); ++p) {
+    const int end_p = spans[p].first + spans[p].second;
+    for (size_t q = p + 1; q < ids.size() &&
+         spans[q].first - spans[p].first < batch->cooccur_window; ++q) {
+      if (spans[q].first < end_p || ids[q] == ids[p]) {
+        continue;
+      }
+      line_pairs.push_back(CooccurrenceCounter::Pair(ids[p], ids[q]));
+    }
+  }
+  sort(line_pairs.begin(), line_pairs.end());
+  line_pairs.erase(unique(line_pairs.begin(), line_pairs.end()),
+                   line_pairs.end());
+  for (uint64_t pair : line_pairs) {
+    batch->pairs[CooccurrenceCounter::ShardGroup(pair, batch->pairs.size())]
+        .push_back(pair);
+    batch->pair_phrases.push_back(int(pair >> 32));
+    batch->pair_phrases.push_back(int(pair & 0xffffffff));
+  }
+}
 
-  int64_t num_lines = 0;
-  int64_t num_doc_lines = 0;
-  int64_t num_probes = 0;
-  int64_t num_hits = 0;
-  char buf[MAX_LINE_LENGTH];
-  while (fgets(buf, sizeof(buf), stdin)) {
-    ++num_lines;
-    if (num_lines > BREAK_AFTER_LINES) {
-      fprintf(stderr, "Enough lines read, quitting after reading %lld lines (%lld doc lines)...\n",
-              num_lines, num_doc_lines);
-      break;
+void CountBatch(LufzUtil* util,
+                const unordered_map<string, int>& lexicon_index,
+                unordered_map<string, string>* token_cache,
+                LineBatch* batch) {
+  batch->hits.clear();
+  batch->num_hits = 0;
+  batch->num_doc_lines = 0;
+  batch->num_probes = 0;
+  batch->unseen_ngrams.clear();
+  batch->doc_starts.clear();
+  for (vector<uint64_t>& group : batch->pairs) {
+    group.clear();
+  }
+  batch->pair_phrases.clear();
+  vector<string> words;
+  string ngram;
+  vector<int> line_ids;
+  vector<pair<int, int>> line_spans;
+  for (const string& line : batch->lines) {
+    if (!strncmp(line.c_str(), "<doc", 4)) {
+      batch->doc_starts.push_back(batch->hits.size());
+      ++batch->num_doc_lines;
+      continue;
     }
-    if (!strncmp(buf, "<doc", 4) || !strncmp(buf, "</doc", 5)) {
-      ++num_doc_lines;
+    if (!strncmp(line.c_str(), "</doc", 5)) {
+      ++batch->num_doc_lines;
       continue;
     }
-    string wikiline = lufz_util.StrLetterizedPrunedPartsOf(string(buf));
-    vector<string> words;
-    int start = 0;
-    for (int i = 0; i < wikiline.length(); ++i) {
+    string wikiline = util->StrLetterizedPrunedPartsOfText(line, token_cache);
+    words.clear();
+    size_t start = 0;
+    for (size_t i = 0; i < wikiline.length(); ++i) {
       if (wikiline[i] == ' ') {
         words.push_back(wikiline.substr(start, i - start));
         start = i + 1;
@@ -66,57 +157,1073 @@ int main(int argc, char* argv[]) {
     if (start < wikiline.length()) {
       words.push_back(wikiline.substr(start));
     }
-    for (int i = 0; i < words.size(); ++i) {
-      for (int j = 1; j <= NGRAM_LIMIT; ++j) {
-        if (i + j > words.size()) {
-          continue;
+    for (size_t i = 0; i < words.size(); ++i) {
+      ngram = words[i];
+      for (int j = 1; j <= NGRAM_LIMIT && i + j <= words.size(); ++j) {
+        if (j > 1) {
+          ngram += ' ';
+          ngram += words[i + j - 1];
         }
-        string ngram = words[i];
-        for (int k = 1; k < j; k++) {
-          ngram += " " + words[i + k];
-        }
-        ++num_probes;
+        ++batch->num_probes;
         const auto& found = lexicon_index.find(ngram);
         if (found != lexicon_index.end()) {
-          lexicon.phrase_infos[found->second].importance += 1;
-          ++num_hits;
+          ++batch->num_hits;
+          if (!batch->counts.empty()) {
+            batch->counts[found->second]++;
+          }
+          if (batch->keep_hits) {
+            batch->hits.push_back(found->second);
+          }
+          if (batch->cooccur_window > 0) {
+            line_ids.push_back(found->second);
+            line_spans.push_back({int(i), j});
+          }
+        } else if (batch->discover && j > 1) {
+          batch->unseen_ngrams[ngram]++;
+        }
+      }
+    }
+    if (batch->cooccur_window > 0) {
+      AddCooccurrences(line_ids, line_spans, batch);
+      line_ids.clear();
+      line_spans.clear();
+    }
+  }
+}
+
+struct SampleOptions {
+  std::string input_file;
+  /**
+   * Fraction of blocks to sample.
+   */
+  double fraction;
+  int64_t block_bytes;
+  uint64_t seed;
+  /**
+   * Rank stability is reported for the top-N phrases.
+   */
+  int top_n;
+  /**
+   * If not empty, per-phrase estimates with confidence intervals are
+   * written here.
+   */
+  std::string report_file;
+};
+
+/**
+ * Returns the indices of the n largest values in v, ignoring index 0 (the
+ * empty phrase).
+ */
+vector<int> TopN(const vector<double>& v, int n) {
+  vector<int> indices;
+  for (size_t i = 1; i < v.size(); ++i) {
+    indices.push_back(i);
+  }
+  n = min(n, int(indices.size()));
+  partial_sort(indices.begin(), indices.begin() + n, indices.end(),
+               [&v](int a, int b) -> bool { return v[a] > v[b]; });
+  indices.resize(n);
+  return indices;
+}
+
+/**
+ * Estimates the counts by splitting the (mmapped) corpus into blocks of
+ * block_bytes and counting the lines that start in a random sample of
+ * the blocks. The estimated count of a phrase is the sample total scaled by
+ * #blocks/#sampled, and the 95% confidence interval comes from the variance
+ * of its per-block counts (with the finite population correction). Sets the
+ * importance of each phrase to 1 + its estimated count.
+ */
+bool CountSampled(LufzUtil* util,
+                  const unordered_map<string, int>& lexicon_index,
+                  const SampleOptions& options,
+                  int num_threads,
+                  Lexicon* lexicon) {
+  int fd = open(options.input_file.c_str(), O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "Could not open %s\n", options.input_file.c_str());
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    fprintf(stderr, "Could not stat %s (or it is empty)\n",
+            options.input_file.c_str());
+    close(fd);
+    return false;
+  }
+  const int64_t size = st.st_size;
+  const char* data = static_cast<const char*>(
+      mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0));
+  close(fd);
+  if (data == MAP_FAILED) {
+    fprintf(stderr, "Could not mmap %s\n", options.input_file.c_str());
+    return false;
+  }
+
+  const int64_t block_bytes = max(options.block_bytes, int64_t(1));
+  const int64_t num_blocks = (size + block_bytes - 1) / block_bytes;
+  int64_t num_sampled = llround(options.fraction * num_blocks);
+  num_sampled = max(int64_t(1), min(num_sampled, num_blocks));
+  vector<int64_t> blocks(num_blocks);
+  for (int64_t b = 0; b < num_blocks; ++b) {
+    blocks[b] = b;
+  }
+  mt19937_64 rng(options.seed);
+  shuffle(blocks.begin(), blocks.end(), rng);
+  blocks.resize(num_sampled);
+  fprintf(stderr, "Sampling %" PRId64 " of %" PRId64 " blocks of %" PRId64
+                  " bytes\n",
+          num_sampled, num_blocks, block_bytes);
+
+  const int num_phrases = lexicon->phrase_infos.size();
+  vector<double> sum(num_phrases, 0), sumsq(num_phrases, 0);
+  // Totals over two halves of the sample, for rank stability.
+  vector<double> half_sums[2] = {vector<double>(num_phrases, 0),
+                                 vector<double>(num_phrases, 0)};
+  int64_t num_lines = 0, num_doc_lines = 0, num_probes = 0, num_hits = 0;
+  const auto start_time = chrono::steady_clock::now();
+
+  vector<LineBatch> batches(num_threads);
+  for (LineBatch& batch : batches) {
+    batch.keep_hits = true;
+  }
+  vector<unordered_map<string, string>> token_caches(num_threads);
+  vector<int> block_counts(num_phrases, 0);
+  for (int64_t next = 0; next < num_sampled; next += num_threads) {
+    const int num_batches = min(int64_t(num_threads), num_sampled - next);
+    for (int t = 0; t < num_batches; ++t) {
+      LineBatch& batch = batches[t];
+      batch.lines.clear();
+      const int64_t start = blocks[next + t] * block_bytes;
+      const int64_t end = min(start + block_bytes, size);
+      // Lines belong to the block in which they start.
+      int64_t pos = start;
+      if (pos > 0 && data[pos - 1] != '\n') {
+        const char* nl = static_cast<const char*>(
+            memchr(data + pos, '\n', size - pos));
+        pos = nl ? (nl - data) + 1 : size;
+      }
+      while (pos < end) {
+        const char* nl = static_cast<const char*>(
+            memchr(data + pos, '\n', size - pos));
+        const int64_t line_end = nl ? (nl - data) + 1 : size;
+        batch.lines.push_back(string(data + pos, line_end - pos));
+        pos = line_end;
+      }
+    }
+    vector<thread> threads;
+    for (int t = 1; t < num_batches; ++t) {
+      threads.push_back(thread(CountBatch, util, cref(lexicon_index),
+                               &token_caches[t], &batches[t]));
+    }
+    CountBatch(util, lexicon_index, &token_caches[0], &batches[0]);
+    for (thread& t : threads) {
+      t.join();
+    }
+    for (int t = 0; t < num_batches; ++t) {
+      const LineBatch& batch = batches[t];
+      num_lines += batch.lines.size();
+      num_doc_lines += batch.num_doc_lines;
+      num_probes += batch.num_probes;
+      num_hits += batch.num_hits;
+      vector<double>& half_sum = half_sums[(next + t) % 2];
+      for (int idx : batch.hits) {
+        block_counts[idx]++;
+      }
+      for (int idx : batch.hits) {
+        if (block_counts[idx] == 0) continue;
+        const double c = block_counts[idx];
+        sum[idx] += c;
+        sumsq[idx] += c * c;
+        half_sum[idx] += c;
+        block_counts[idx] = 0;
+      }
+    }
+  }
+  munmap(const_cast<char*>(data), size);
+
+  const double secs = chrono::duration<double>(
+      chrono::steady_clock::now() - start_time).count();
+  fprintf(stderr, "Sampled %" PRId64 " lines (%" PRId64 " doc lines) in "
+                  "%.1f s\n",
+          num_lines, num_doc_lines, secs);
+  fprintf(stderr, "#probes: %" PRId64 " #hits: %" PRId64 "...\n", num_probes,
+          num_hits);
+
+  const double n = num_sampled;
+  const double scale = num_blocks / n;
+  const double fpc = 1.0 - n / num_blocks;
+  vector<double> estimates(num_phrases, 0), margins(num_phrases, 0);
+  for (int i = 0; i < num_phrases; ++i) {
+    estimates[i] = sum[i] * scale;
+    if (num_sampled > 1) {
+      const double mean = sum[i] / n;
+      const double variance = max(0.0, (sumsq[i] - n * mean * mean) / (n - 1));
+      margins[i] = 1.96 * num_blocks * sqrt(fpc * variance / n);
+    }
+    lexicon->phrase_infos[i].importance = 1 + estimates[i];
+  }
+
+  for (int top_n = options.top_n; top_n >= 10; top_n /= 10) {
+    vector<int> top[2] = {TopN(half_sums[0], top_n),
+                          TopN(half_sums[1], top_n)};
+    set<int> top0(top[0].begin(), top[0].end());
+    int common = 0;
+    for (int idx : top[1]) {
+      common += top0.count(idx);
+    }
+    vector<int> top_all = TopN(estimates, top_n);
+    double rel_margin = 0;
+    for (int idx : top_all) {
+      rel_margin += estimates[idx] > 0 ? margins[idx] / estimates[idx] : 0;
+    }
+    fprintf(stderr, "Top-%d: %.1f%% overlap between the two half-samples, "
+                    "mean relative 95%% CI half-width: %.1f%%\n",
+            top_n, top[0].empty() ? 0 : 100.0 * common / top[0].size(),
+            top_all.empty() ? 0 : 100.0 * rel_margin / top_all.size());
+  }
+
+  if (!options.report_file.empty()) {
+    FILE* fp = fopen(options.report_file.c_str(), "w");
+    if (!fp) {
+      fprintf(stderr, "Could not open %s\n", options.report_file.c_str());
+      return false;
+    }
+    vector<int> order = TopN(estimates, num_phrases);
+    for (int idx : order) {
+      fprintf(fp, "%.1f\t%.1f\t%.1f\t%s\n", estimates[idx],
+              max(0.0, estimates[idx] - margins[idx]),
+              estimates[idx] + margins[idx],
+              lexicon->phrase_infos[idx].normalized.c_str());
+    }
+    fclose(fp);
+    fprintf(stderr, "Wrote estimates with 95%% confidence intervals to %s\n",
+            options.report_file.c_str());
+  }
+  return true;
+}
+
+/**
+ * Returns the importance tier of each phrase: floor(log2(1 + rank)), where
+ * rank is the number of phrases with a strictly higher count (so tied
+ * phrases, such as all the unseen ones, share a tier).
+ */
+vector<int> ImportanceTiers(const vector<int64_t>& counts) {
+  const int num_phrases = counts.size();
+  vector<int> order(num_phrases);
+  for (int i = 0; i < num_phrases; ++i) {
+    order[i] = i;
+  }
+  sort(order.begin(), order.end(), [&counts](int a, int b) -> bool {
+    return counts[a] > counts[b];
+  });
+  vector<int> tiers(num_phrases);
+  int rank = 0;
+  for (int i = 0; i < num_phrases; ++i) {
+    if (i > 0 && counts[order[i]] != counts[order[i - 1]]) {
+      rank = i;
+    }
+    tiers[order[i]] = ilogb(1.0 + rank);
+  }
+  return tiers;
+}
+
+/**
+ * Pearson correlation of a and b (which must have the same size). Returns
+ * 1 if either is constant and they are equal, else 0 if either is constant.
+ */
+double Correlation(const vector<int>& a, const vector<int>& b) {
+  const double n = a.size();
+  double sa = 0, sb = 0, saa = 0, sbb = 0, sab = 0;
+  for (size_t i = 0; i < a.size(); ++i) {
+    sa += a[i];
+    sb += b[i];
+    saa += double(a[i]) * a[i];
+    sbb += double(b[i]) * b[i];
+    sab += double(a[i]) * b[i];
+  }
+  const double va = saa - sa * sa / n;
+  const double vb = sbb - sb * sb / n;
+  if (va <= 0 || vb <= 0) {
+    return a == b ? 1 : 0;
+  }
+  return (sab - sa * sb / n) / sqrt(va * vb);
+}
+
+/**
+ * A 64-bit FNV-1a hash of line (the same in every build, unlike
+ * std::hash), with a final mix so that the low bits, which pick the
+ * CuckooFilter bucket, depend on all of the bytes.
+ */
+uint64_t LineHash(string_view line) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (unsigned char c : line) {
+    hash ^= c;
+    hash *= 1099511628211ULL;
+  }
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+/**
+ * With --dedup: returns true if line should be skipped, as it repeats an
+ * earlier line (per filter), and it is not every keep_every-th repeat (if
+ * keep_every > 0). Doc lines are never skipped.
+ */
+bool SkipRepeatedLine(string_view line, int64_t keep_every,
+                      CuckooFilter* filter, int64_t* num_repeat_lines) {
+  if (line.substr(0, 4) == "<doc" || line.substr(0, 5) == "</doc" ||
+      !filter->TestAndInsert(LineHash(line))) {
+    return false;
+  }
+  ++*num_repeat_lines;
+  return keep_every <= 0 || *num_repeat_lines % keep_every != 0;
+}
+
+/**
+ * On resuming with --dedup: the filter is not saved in checkpoints (that
+ * would make each of them --dedup_memory_mb big, and take as long to
+ * write), so it gets rebuilt, along with *num_repeat_lines, by reading the
+ * lines from the current position of reader up to end_offset again. That
+ * only hashes them, which is much faster than counting them was. Returns
+ * false if the input ends before end_offset.
+ */
+bool ReplayDedupFilter(LineReader* reader, int64_t end_offset,
+                       int64_t keep_every, CuckooFilter* filter,
+                       int64_t* num_repeat_lines) {
+  string_view line;
+  while (reader->Offset() < end_offset) {
+    if (!reader->Next(&line)) {
+      return false;
+    }
+    SkipRepeatedLine(line, keep_every, filter, num_repeat_lines);
+  }
+  return reader->Offset() == end_offset;
+}
+
+/**
+ * NgramDiscoverer only gives lower bounds for the counts of its candidates
+ * (they miss the counts from before they became candidates), so this counts
+ * the n-grams in *top exactly, in a second pass over the lines of
+ * input_file in [start_offset, end_offset). With dedup_memory_bytes > 0,
+ * the same repeated lines as in the first pass are skipped (using a fresh
+ * filter, which makes the same decisions). Then keeps those with counts >=
+ * min_count in *top, at most max_results of them, sorted by decreasing
+ * count.
+ */
+bool RecountNgrams(LufzUtil* util,
+                   const unordered_map<string, int>& lexicon_index,
+                   const string& input_file,
+                   int64_t start_offset,
+                   int64_t end_offset,
+                   size_t dedup_memory_bytes,
+                   int64_t dedup_keep_every,
+                   vector<unordered_map<string, string>>* token_caches,
+                   int64_t min_count,
+                   size_t max_results,
+                   vector<pair<string, int64_t>>* top) {
+  LineReader reader;
+  if (!reader.Open(input_file) ||
+      (start_offset > 0 && !reader.SkipTo(start_offset))) {
+    fprintf(stderr, "Could not read %s again from offset %" PRId64 "\n",
+            input_file.c_str(), start_offset);
+    return false;
+  }
+  unordered_map<string, int64_t> counts;
+  for (const auto& [ngram, count] : *top) {
+    counts[ngram] = 0;
+  }
+  CuckooFilter dedup_filter(dedup_memory_bytes);
+  int64_t num_repeat_lines = 0;
+  vector<LineBatch> batches(token_caches->size());
+  for (LineBatch& batch : batches) {
+    batch.discover = true;
+  }
+  string_view line;
+  bool done = false;
+  while (!done) {
+    int num_batches = 0;
+    for (LineBatch& batch : batches) {
+      batch.lines.clear();
+      while (!done && batch.lines.size() < BATCH_LINES) {
+        if (reader.Offset() >= end_offset || !reader.Next(&line)) {
+          done = true;
+        } else if (dedup_memory_bytes == 0 ||
+                   !SkipRepeatedLine(line, dedup_keep_every, &dedup_filter,
+                                     &num_repeat_lines)) {
+          batch.lines.emplace_back(line);
+        }
+      }
+      if (batch.lines.empty()) {
+        break;
+      }
+      ++num_batches;
+    }
+    vector<thread> threads;
+    for (int t = 1; t < num_batches; ++t) {
+      threads.push_back(thread(CountBatch, util, cref(lexicon_index),
+                               &(*token_caches)[t], &batches[t]));
+    }
+    if (num_batches > 0) {
+      CountBatch(util, lexicon_index, &(*token_caches)[0], &batches[0]);
+    }
+    for (thread& t : threads) {
+      t.join();
+    }
+    for (int t = 0; t < num_batches; ++t) {
+      for (const auto& [ngram, count] : batches[t].unseen_ngrams) {
+        auto it = counts.find(ngram);
+        if (it != counts.end()) {
+          it->second += count;
+        }
+      }
+    }
+  }
+  if (reader.Failed()) {
+    return false;
+  }
+
+  top->clear();
+  for (const auto& [ngram, count] : counts) {
+    if (count >= min_count) {
+      top->push_back({ngram, count});
+    }
+  }
+  sort(top->begin(), top->end(),
+       [](const pair<string, int64_t>& a, const pair<string, int64_t>& b) {
+         if (a.second == b.second) {
+           return a.first < b.first;
+         }
+         return a.second > b.second;
+       });
+  if (top->size() > max_results) {
+    top->resize(max_results);
+  }
+  return true;
+}
+
+/**
+ * Sums up the per-thread hit counts of batches into *counts.
+ */
+void ReduceCounts(const vector<LineBatch>& batches, vector<int64_t>* counts) {
+  counts->assign(batches[0].counts.size(), 0);
+  for (const LineBatch& batch : batches) {
+    for (size_t i = 0; i < batch.counts.size(); ++i) {
+      (*counts)[i] += batch.counts[i];
+    }
+  }
+}
+
+/**
+ * Copies the counting state into *counts, for checkpointing.
+ */
+void SnapshotCounts(const vector<LineBatch>& batches,
+                    const DocFreqCounter& doc_freq_counter,
+                    PopularityCounts* counts) {
+  ReduceCounts(batches, &counts->counts);
+  doc_freq_counter.Snapshot(&counts->open_doc_phrases);
+}
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  vector<string> args;
+  map<string, string> flags;
+  if (!ParseArgs(argc, argv,
+                 {"input", "checkpoint", "checkpoint_every_secs", "resume",
+                  "byte_range", "shard_out", "max_lines", "max_bytes",
+                  "threads", "sample", "sample_block_bytes", "sample_seed",
+                  "sample_top_n", "sample_report", "converge",
+                  "converge_every_lines", "discover", "discover_top",
+                  "discover_min_count", "discover_buffer", "doc_freq",
+                  "cooccur", "cooccur_window", "cooccur_max_pairs",
+                  "cooccur_min_count", "cooccur_top", "dedup",
+                  "dedup_keep_every", "dedup_memory_mb"},
+                 &args, &flags) ||
+      args.size() != 2) {
+    fprintf(stderr, "Usage: %s <Language> <lexicon-file> "
+                    "[--input=<corpus-file>] [--checkpoint=<file>] "
+                    "[--checkpoint_every_secs=<secs>] [--resume] "
+                    "[--byte_range=<start>:<end>] [--shard_out=<file>] "
+                    "[--max_lines=<n>] [--max_bytes=<n>] [--threads=<n>] "
+                    "[--sample=<fraction> [--sample_block_bytes=<n>] "
+                    "[--sample_seed=<n>] [--sample_top_n=<n>] "
+                    "[--sample_report=<file>]] "
+                    "[--converge=<threshold> [--converge_every_lines=<n>]] "
+                    "[--discover=<file> [--discover_top=<n>] "
+                    "[--discover_min_count=<n>] [--discover_buffer=<n>]] "
+                    "[--doc_freq=<file>] "
+                    "[--cooccur=<file> [--cooccur_window=<n>] "
+                    "[--cooccur_max_pairs=<n>] [--cooccur_min_count=<n>] "
+                    "[--cooccur_top=<n>]] "
+                    "[--dedup [--dedup_keep_every=<n>] "
+                    "[--dedup_memory_mb=<n>]]\n",
+            argv[0]);
+    fprintf(stderr, "  The corpus is read from stdin if --input is not given.\n");
+    fprintf(stderr, "  With --checkpoint, counts are periodically saved to "
+                    "<file>. With --resume,\n  counting continues from the "
+                    "state saved in <file>.\n");
+    fprintf(stderr, "  With --byte_range, only lines starting at byte offsets "
+                    "in [start, end) are\n  counted. With --shard_out, the "
+                    "counts are written to <file> as a shard\n  for "
+                    "merge-popularity-shards, instead of printing the "
+                    "importance TSV.\n");
+    fprintf(stderr, "  Counting stops after --max_lines lines (default: "
+                    "30000000, 0 means no limit)\n  or after --max_bytes "
+                    "bytes (default: 0, no limit). It uses --threads\n  "
+                    "threads (default: the number of cores).\n");
+    fprintf(stderr, "  With --sample, the --input file is split into blocks "
+                    "(default: 1MB) and only\n  the given fraction of them, "
+                    "picked at random, is counted. The counts are\n  scaled "
+                    "up, and rank stability of the top phrases is reported. "
+                    "Per-phrase\n  estimates with 95%% confidence intervals "
+                    "are written to --sample_report.\n");
+    fprintf(stderr, "  With --converge, counting stops early once the "
+                    "importance tiers\n  (log2 of rank) of the phrases stop "
+                    "changing: i.e., once 1 - their correlation\n  with the "
+                    "tiers --converge_every_lines (default: 1000000) lines "
+                    "earlier\n  stays below the threshold (e.g., 0.0001).\n");
+    fprintf(stderr, "  With --discover, the --discover_top (default: 10000) "
+                    "most frequent\n  2-%d-grams that are not in the lexicon "
+                    "(and occur at least\n  --discover_min_count times, "
+                    "default: 2) are written to <file> with\n  their counts. "
+                    "Memory use is bounded: at most --discover_buffer "
+                    "(default:\n  4000000) distinct counts are held in memory "
+                    "before being spilled to\n  <file>.tmp.run* files. The "
+                    "candidates are counted exactly in a second pass\n  over "
+                    "the --input file (not with stdin, where the counts are "
+                    "lower bounds).\n",
+            NGRAM_LIMIT);
+    fprintf(stderr, "  With --doc_freq, the number of documents (<doc> ... "
+                    "</doc>) in which\n  each phrase occurs is also counted, "
+                    "and an importance TSV based on\n  that is written to "
+                    "<file>.\n");
+    fprintf(stderr, "  With --cooccur, pairs of phrases that occur in a line "
+                    "within\n  --cooccur_window (default: 10) words of each "
+                    "other are counted, and\n  for each phrase, the "
+                    "--cooccur_top (default: 20) associated phrases with\n  "
+                    "the highest PMI (among pairs seen at least "
+                    "--cooccur_min_count times,\n  default: 5) are written "
+                    "to <file> as <phrase>\\t<associate>\\t<count>\\t<pmi>."
+                    "\n  Rare pairs are pruned away whenever there are more "
+                    "than\n  --cooccur_max_pairs (default: 50000000) of "
+                    "them.\n");
+    fprintf(stderr, "  With --dedup, lines that exactly repeat an earlier "
+                    "line (such as\n  boilerplate from templates) are "
+                    "skipped, except that every\n  --dedup_keep_every-th "
+                    "repeat is counted if that is set. Repeats are\n  "
+                    "spotted using a filter of line hashes that takes "
+                    "--dedup_memory_mb\n  (default: 256) of memory. It is "
+                    "not saved in checkpoints: --resume\n  rebuilds it by "
+                    "reading the corpus up to the checkpoint again.\n");
+    return 1;
+  }
+  LufzUtil lufz_util(args[0]);
+
+  Lexicon lexicon;
+  if (!lufz_util.ReadLexicon(args[1].c_str(), &lexicon)) {
+    return 1;
+  }
+
+  unordered_map<string, int> lexicon_index;
+  for (size_t i = 0; i < lexicon.phrase_infos.size(); ++i) {
+    lexicon_index[lexicon.phrase_infos[i].normalized] = i;
+  }
+
+  /**
+   * The default budget (the first 30M lines of the corpus) dates from when
+   * counting was much slower. Pass --max_lines=0 to count everything.
+   */
+  const int64_t max_lines = flags.count("max_lines") > 0 ?
+      atoll(flags["max_lines"].c_str()) : 30000000;
+  const int64_t max_bytes = flags.count("max_bytes") > 0 ?
+      atoll(flags["max_bytes"].c_str()) : 0;
+  int num_threads = flags.count("threads") > 0 ?
+      atoi(flags["threads"].c_str()) : thread::hardware_concurrency();
+  if (num_threads < 1) {
+    num_threads = 1;
+  }
+
+  if (flags.count("sample") > 0) {
+    SampleOptions options;
+    options.input_file = flags["input"];
+    options.fraction = atof(flags["sample"].c_str());
+    options.block_bytes = flags.count("sample_block_bytes") > 0 ?
+        atoll(flags["sample_block_bytes"].c_str()) : 1 << 20;
+    options.seed = flags.count("sample_seed") > 0 ?
+        strtoull(flags["sample_seed"].c_str(), nullptr, 10) : 42;
+    options.top_n = flags.count("sample_top_n") > 0 ?
+        atoi(flags["sample_top_n"].c_str()) : 10000;
+    options.report_file = flags["sample_report"];
+    if (options.input_file.empty() || options.input_file == "-" ||
+        options.fraction <= 0 || options.fraction > 1) {
+      fprintf(stderr, "--sample needs a fraction in (0, 1] and --input\n");
+      return 1;
+    }
+    if (!CountSampled(&lufz_util, lexicon_index, options, num_threads,
+                      &lexicon)) {
+      return 1;
+    }
+    PrintImportances(&lexicon, stdout);
+    return 0;
+  }
+
+  LineReader reader;
+  if (!reader.Open(flags.count("input") > 0 ? flags["input"] : "-")) {
+    return 1;
+  }
+  const string checkpoint_file = flags["checkpoint"];
+  const int checkpoint_every_secs = flags.count("checkpoint_every_secs") > 0 ?
+      atoi(flags["checkpoint_every_secs"].c_str()) : 300;
+  if (flags.count("resume") > 0 && checkpoint_file.empty()) {
+    fprintf(stderr, "--resume needs --checkpoint\n");
+    return 1;
+  }
+  // Checkpoints do not have the state of these, so a resumed run would not
+  // give the same results as an uninterrupted one.
+  for (const char* flag : {"discover", "cooccur", "converge"}) {
+    if (flags.count("resume") > 0 && flags.count(flag) > 0) {
+      fprintf(stderr, "--resume cannot be used with --%s\n", flag);
+      return 1;
+    }
+  }
+
+  const string shard_file = flags["shard_out"];
+  int64_t range_start = 0;
+  int64_t range_end = -1;
+  if (flags.count("byte_range") > 0 &&
+      sscanf(flags["byte_range"].c_str(), "%" SCNd64 ":%" SCNd64,
+             &range_start, &range_end) != 2) {
+    fprintf(stderr, "Bad --byte_range: %s\n", flags["byte_range"].c_str());
+    return 1;
+  }
+  if (max_bytes > 0 &&
+      (range_end < 0 || range_start + max_bytes < range_end)) {
+    range_end = range_start + max_bytes;
+  }
+
+  const string doc_freq_file = flags["doc_freq"];
+  DocFreqCounter doc_freq_counter(
+      doc_freq_file.empty() ? 0 : lexicon.phrase_infos.size());
+
+  /**
+   * With --dedup, lines that exactly repeat an earlier line (spotted with a
+   * CuckooFilter of line hashes, which uses --dedup_memory_mb of memory) are
+   * not counted, except for every --dedup_keep_every-th repeat, if set.
+   * Doc lines are never skipped.
+   */
+  const bool dedup = flags.count("dedup") > 0;
+  const int64_t dedup_keep_every = flags.count("dedup_keep_every") > 0 ?
+      atoll(flags["dedup_keep_every"].c_str()) : 0;
+  const int64_t dedup_memory_mb = flags.count("dedup_memory_mb") > 0 ?
+      atoll(flags["dedup_memory_mb"].c_str()) : 256;
+  CuckooFilter dedup_filter(dedup ? (dedup_memory_mb << 20) : 0);
+  int64_t num_repeat_lines = 0;
+
+  PopularityCounts state;
+  state.fingerprint = LexiconFingerprint(lexicon);
+  if (!doc_freq_file.empty()) {
+    state.doc_counts.resize(lexicon.phrase_infos.size());
+  }
+  const bool resume = flags.count("resume") > 0;
+  if ((!resume || dedup) && range_start > 0) {
+    // Start at the first line that begins at or after range_start. The
+    // line straddling range_start belongs to the previous range. (On
+    // resuming with --dedup, the lines from there on get read again.)
+    if (!reader.SkipTo(range_start - 1)) {
+      fprintf(stderr, "Could not skip to offset %" PRId64 " in input\n",
+              range_start);
+      return 1;
+    }
+    string_view partial_line;
+    reader.Next(&partial_line);
+    state.input_offset = reader.Offset();
+  }
+  if (resume) {
+    PopularityCounts saved;
+    if (!ReadPopularityCounts(checkpoint_file.c_str(), &saved)) {
+      return 1;
+    }
+    if (saved.fingerprint != state.fingerprint ||
+        saved.counts.size() != lexicon.phrase_infos.size()) {
+      fprintf(stderr, "Checkpoint %s is for a different lexicon\n",
+              checkpoint_file.c_str());
+      return 1;
+    }
+    if (dedup) {
+      fprintf(stderr, "Rebuilding the --dedup filter from the input up to "
+                      "offset %" PRId64 "...\n", saved.input_offset);
+      if (!ReplayDedupFilter(&reader, saved.input_offset, dedup_keep_every,
+                             &dedup_filter, &num_repeat_lines)) {
+        fprintf(stderr, "Could not read up to offset %" PRId64 " in input\n",
+                saved.input_offset);
+        return 1;
+      }
+    } else if (!reader.SkipTo(saved.input_offset)) {
+      fprintf(stderr, "Could not skip to offset %" PRId64 " in input\n",
+              saved.input_offset);
+      return 1;
+    }
+    if (!doc_freq_file.empty()) {
+      if (saved.doc_counts.size() != lexicon.phrase_infos.size() ||
+          !doc_freq_counter.Restore(saved.open_doc_phrases)) {
+        fprintf(stderr, "Checkpoint %s does not have document frequencies\n",
+                checkpoint_file.c_str());
+        return 1;
+      }
+    }
+    state = saved;
+    fprintf(stderr, "Resuming from %s at offset %" PRId64 ", after %" PRId64
+                    " lines\n",
+            checkpoint_file.c_str(), state.input_offset, state.num_lines);
+  }
+  time_t last_checkpoint_time = time(nullptr);
+
+  int64_t& num_lines = state.num_lines;
+  int64_t& num_doc_lines = state.num_doc_lines;
+  int64_t& num_probes = state.num_probes;
+  int64_t& num_hits = state.num_hits;
+
+  /**
+   * Each round, we read BATCH_LINES lines for each thread, count them in
+   * parallel, and then apply the results in order (so checkpoints are always
+   * at a round boundary).
+   */
+  vector<LineBatch> batches(num_threads);
+  for (LineBatch& batch : batches) {
+    batch.counts.assign(lexicon.phrase_infos.size(), 0);
+    batch.keep_hits = !doc_freq_file.empty();
+  }
+  // Counts from a checkpoint being resumed.
+  for (size_t i = 0; i < state.counts.size(); ++i) {
+    batches[0].counts[i] = state.counts[i];
+  }
+  vector<unordered_map<string, string>> token_caches(num_threads);
+  const auto start_time = chrono::steady_clock::now();
+  const int64_t start_lines = num_lines;
+  const int64_t start_offset = state.input_offset;
+  int64_t next_progress_lines = (num_lines / 100000 + 1) * 100000;
+
+  /**
+   * With --converge, every converge_every_lines lines we compare the
+   * importance tiers of all phrases against those at the previous check,
+   * and stop once their correlation has stayed within converge_threshold of
+   * 1 for CONVERGE_PATIENCE checks in a row.
+   */
+  const double converge_threshold = flags.count("converge") > 0 ?
+      atof(flags["converge"].c_str()) : 0;
+  const int64_t converge_every_lines =
+      flags.count("converge_every_lines") > 0 ?
+      max(1LL, atoll(flags["converge_every_lines"].c_str())) : 1000000;
+  const int CONVERGE_PATIENCE = 2;
+  int64_t next_converge_lines =
+      (num_lines / converge_every_lines + 1) * converge_every_lines;
+  vector<int> prev_tiers;
+  int num_stable_checks = 0;
+
+  /**
+   * With --discover, we also find the most frequent 2..NGRAM_LIMIT-grams
+   * that are not in the lexicon. If that fails, counting goes on without
+   * it (and the main output still gets written), but we exit with 1.
+   */
+  const string discover_file = flags["discover"];
+  unique_ptr<NgramDiscoverer> discoverer;
+  bool discover_failed = false;
+  if (!discover_file.empty()) {
+    const int64_t discover_top = flags.count("discover_top") > 0 ?
+        atoll(flags["discover_top"].c_str()) : 10000;
+    const int64_t discover_buffer = flags.count("discover_buffer") > 0 ?
+        atoll(flags["discover_buffer"].c_str()) : 4000000;
+    discoverer.reset(new NgramDiscoverer(
+        discover_file + ".tmp", 2 * discover_top, discover_buffer));
+    for (LineBatch& batch : batches) {
+      batch.discover = true;
+    }
+  }
+
+  /**
+   * With --cooccur, we also count co-occurrences of lexicon phrases, for
+   * finding associated phrases by PMI.
+   */
+  const string cooccur_file = flags["cooccur"];
+  const int64_t cooccur_max_pairs = flags.count("cooccur_max_pairs") > 0 ?
+      atoll(flags["cooccur_max_pairs"].c_str()) : 50000000;
+  CooccurrenceCounter cooccurrences(cooccur_max_pairs);
+  vector<int64_t> pair_counts;
+  int64_t num_pairs = 0;
+  if (!cooccur_file.empty()) {
+    const int cooccur_window = flags.count("cooccur_window") > 0 ?
+        max(1, atoi(flags["cooccur_window"].c_str())) : 10;
+    for (LineBatch& batch : batches) {
+      batch.cooccur_window = cooccur_window;
+      batch.pairs.resize(num_threads);
+    }
+    pair_counts.resize(lexicon.phrase_infos.size());
+  }
+
+  int64_t num_skipped_lines = 0;
+  int64_t num_skipped_bytes = 0;
+
+  string_view line;
+  bool done = false;
+  while (!done) {
+    int num_batches = 0;
+    for (LineBatch& batch : batches) {
+      batch.lines.clear();
+      while (!done && batch.lines.size() < BATCH_LINES) {
+        if (max_lines > 0 && num_lines >= max_lines) {
+          fprintf(stderr, "Enough lines read, quitting after reading %" PRId64
+                          " lines (%" PRId64 " doc lines)...\n",
+                  num_lines, num_doc_lines);
+          done = true;
+        } else if ((range_end >= 0 && state.input_offset >= range_end) ||
+                   !reader.Next(&line)) {
+          done = true;
+        } else {
+          ++num_lines;
+          const size_t len = line.size();
+          state.input_offset = reader.Offset();
+          if (dedup && SkipRepeatedLine(line, dedup_keep_every,
+                                        &dedup_filter, &num_repeat_lines)) {
+            ++num_skipped_lines;
+            num_skipped_bytes += len;
+            continue;
+          }
+          batch.lines.emplace_back(line);
+        }
+      }
+      if (batch.lines.empty()) {
+        break;
+      }
+      ++num_batches;
+    }
+    vector<thread> threads;
+    for (int t = 1; t < num_batches; ++t) {
+      threads.push_back(thread(CountBatch, &lufz_util, cref(lexicon_index),
+                               &token_caches[t], &batches[t]));
+    }
+    if (num_batches > 0) {
+      CountBatch(&lufz_util, lexicon_index, &token_caches[0], &batches[0]);
+    }
+    for (thread& t : threads) {
+      t.join();
+    }
+    for (int t = 0; t < num_batches; ++t) {
+      const LineBatch& batch = batches[t];
+      num_doc_lines += batch.num_doc_lines;
+      num_probes += batch.num_probes;
+      num_hits += batch.num_hits;
+      if (!doc_freq_file.empty()) {
+        doc_freq_counter.Apply(batch.hits, batch.doc_starts,
+                               &state.doc_counts);
+      }
+      if (discoverer) {
+        for (const auto& [ngram, count] : batch.unseen_ngrams) {
+          if (!discoverer->Add(ngram, count)) {
+            fprintf(stderr, "Giving up on --discover\n");
+            discoverer.reset();
+            discover_failed = true;
+            for (LineBatch& b : batches) {
+              b.discover = false;
+            }
+            break;
+          }
+        }
+      }
+    }
+    if (!cooccur_file.empty()) {
+      vector<const vector<vector<uint64_t>>*> buffers;
+      for (int t = 0; t < num_batches; ++t) {
+        const LineBatch& batch = batches[t];
+        buffers.push_back(&batch.pairs);
+        num_pairs += batch.pair_phrases.size() / 2;
+        for (int idx : batch.pair_phrases) {
+          pair_counts[idx]++;
         }
       }
+      cooccurrences.Add(buffers);
     }
-    if (num_lines % 100000 == 0) {
-      fprintf(stderr, "After reading %lld lines (%lld doc lines)...\n",
+
+    if (num_lines >= next_progress_lines || done) {
+      next_progress_lines = (num_lines / 100000 + 1) * 100000;
+      const double secs = chrono::duration<double>(
+          chrono::steady_clock::now() - start_time).count();
+      const double mbytes = (state.input_offset - start_offset) / 1e6;
+      fprintf(stderr, "After reading %" PRId64 " lines (%" PRId64
+                      " doc lines)...\n",
               num_lines, num_doc_lines);
-      fprintf(stderr, "#probes: %lld #hits: %lld...\n", num_probes, num_hits);
+      fprintf(stderr, "#probes: %" PRId64 " #hits: %" PRId64 "...\n",
+              num_probes, num_hits);
+      fprintf(stderr, "Throughput: %.0f lines/s, %.2f MB/s (%.1f MB in %.1f s, "
+                      "%d threads)\n",
+              (num_lines - start_lines) / max(secs, 1e-9),
+              mbytes / max(secs, 1e-9), mbytes, secs, num_threads);
+      if (dedup) {
+        fprintf(stderr, "Dedup: skipped %" PRId64 " repeated lines (%.1f%% of "
+                        "lines, %.1f%% of bytes), filter has %zu/%zu entries "
+                        "(%" PRId64 " resets)\n",
+                num_skipped_lines,
+                100.0 * num_skipped_lines / max(num_lines - start_lines,
+                                                int64_t(1)),
+                100.0 * num_skipped_bytes /
+                    max(state.input_offset - start_offset, int64_t(1)),
+                dedup_filter.Size(), dedup_filter.Capacity(),
+                dedup_filter.NumResets());
+      }
       int samples = 20;
       int step = (lexicon.phrase_infos.size() / samples) - 1;
       for (int i = 0; i < 20; ++i) {
         int idx = (step * i + 42) % lexicon.phrase_infos.size();
-        fprintf(stderr, "%llf %s\n", lexicon.phrase_infos[idx].importance,
+        int64_t count = 0;
+        for (const LineBatch& batch : batches) {
+          count += batch.counts[idx];
+        }
+        fprintf(stderr, "%" PRId64 " %s\n", 1 + count,
                 lexicon.phrase_infos[idx].normalized.c_str());
       }
     }
+    if (converge_threshold > 0 && !done && num_lines >= next_converge_lines) {
+      next_converge_lines =
+          (num_lines / converge_every_lines + 1) * converge_every_lines;
+      ReduceCounts(batches, &state.counts);
+      vector<int> tiers = ImportanceTiers(state.counts);
+      if (!prev_tiers.empty()) {
+        const double correlation = Correlation(prev_tiers, tiers);
+        int num_changed = 0;
+        for (size_t i = 0; i < tiers.size(); ++i) {
+          num_changed += (tiers[i] != prev_tiers[i]);
+        }
+        fprintf(stderr, "Convergence at %" PRId64 " lines: tier correlation "
+                        "%.6f, %d phrases changed tiers\n",
+                num_lines, correlation, num_changed);
+        num_stable_checks =
+            (1 - correlation < converge_threshold) ? num_stable_checks + 1 : 0;
+        if (num_stable_checks >= CONVERGE_PATIENCE) {
+          fprintf(stderr, "Importance tiers have converged, quitting after "
+                          "reading %" PRId64 " lines (%" PRId64
+                          " doc lines)...\n",
+                  num_lines, num_doc_lines);
+          done = true;
+        }
+      }
+      prev_tiers.swap(tiers);
+    }
+    if (!checkpoint_file.empty() &&
+        time(nullptr) - last_checkpoint_time >= checkpoint_every_secs) {
+      SnapshotCounts(batches, doc_freq_counter, &state);
+      if (WritePopularityCounts(checkpoint_file.c_str(), state)) {
+        fprintf(stderr, "Checkpointed after %" PRId64 " lines at offset %"
+                        PRId64 "\n",
+                num_lines, state.input_offset);
+      }
+      last_checkpoint_time = time(nullptr);
+    }
+  }
+  SnapshotCounts(batches, doc_freq_counter, &state);
+  if (!checkpoint_file.empty()) {
+    WritePopularityCounts(checkpoint_file.c_str(), state);
+  }
+  if (reader.Failed()) {
+    // The counts so far are in the checkpoint (if any), to resume from.
+    fprintf(stderr, "Not writing any output, as reading the input failed at "
+                    "offset %" PRId64 "\n", state.input_offset);
+    return 1;
+  }
+
+  if (discoverer) {
+    vector<pair<string, int64_t>> top;
+    const int64_t discover_top = flags.count("discover_top") > 0 ?
+        atoll(flags["discover_top"].c_str()) : 10000;
+    const int64_t discover_min_count = flags.count("discover_min_count") > 0 ?
+        atoll(flags["discover_min_count"].c_str()) : 2;
+    fprintf(stderr, "Merging %" PRId64 " spilled runs of n-gram counts...\n",
+            discoverer->NumSpilledRuns());
+    // Unless the corpus came from stdin, all the candidates are counted
+    // again exactly before picking the top ones.
+    const string input_file = flags["input"];
+    const bool recount = !input_file.empty() && input_file != "-";
+    bool ok = discoverer->Finish(recount ? 1 : discover_min_count,
+                                 recount ? SIZE_MAX : discover_top, &top);
+    discoverer.reset();
+    if (ok && recount) {
+      fprintf(stderr, "Counting %zu candidate n-grams exactly in a second "
+                      "pass over the input...\n", top.size());
+      dedup_filter = CuckooFilter(0);  // Frees its memory.
+      ok = RecountNgrams(&lufz_util, lexicon_index, input_file, start_offset,
+                         state.input_offset,
+                         dedup ? (dedup_memory_mb << 20) : 0,
+                         dedup_keep_every, &token_caches, discover_min_count,
+                         discover_top, &top);
+    }
+    FILE* dfp = nullptr;
+    if (!ok) {
+      discover_failed = true;
+    } else if (!(dfp = fopen(discover_file.c_str(), "w"))) {
+      fprintf(stderr, "Could not open %s\n", discover_file.c_str());
+      discover_failed = true;
+    } else {
+      for (const auto& [ngram, count] : top) {
+        fprintf(dfp, "%" PRId64 "\t%s\n", count, ngram.c_str());
+      }
+      fclose(dfp);
+      fprintf(stderr, "Wrote %zu frequent n-grams missing from the lexicon "
+                      "to %s%s\n", top.size(), discover_file.c_str(),
+              recount ? "" : " (their counts are lower bounds)");
+    }
   }
 
-  sort(lexicon.phrase_infos.begin() + 1, lexicon.phrase_infos.end(),
-       [](const PhraseInfo& a, const PhraseInfo& b) -> bool {
-         return a.importance > b.importance;
-       });
-  if (lexicon.phrase_infos.size() > 1) {
-    lexicon.phrase_infos[0].importance = std::max(
-        lexicon.phrase_infos[0].importance,
-        lexicon.phrase_infos[1].importance + 1);
+  if (!cooccur_file.empty()) {
+    const int64_t cooccur_min_count = flags.count("cooccur_min_count") > 0 ?
+        atoll(flags["cooccur_min_count"].c_str()) : 5;
+    const int cooccur_top = flags.count("cooccur_top") > 0 ?
+        atoi(flags["cooccur_top"].c_str()) : 20;
+    vector<vector<CooccurrenceCounter::Associate>> associates;
+    cooccurrences.TopAssociates(pair_counts, num_pairs,
+                                cooccur_min_count, cooccur_top, &associates);
+    FILE* cfp = fopen(cooccur_file.c_str(), "w");
+    if (!cfp) {
+      fprintf(stderr, "Could not open %s\n", cooccur_file.c_str());
+      return 1;
+    }
+    for (size_t i = 0; i < associates.size(); ++i) {
+      for (const auto& associate : associates[i]) {
+        fprintf(cfp, "%s\t%s\t%" PRId64 "\t%.3f\n",
+                lexicon.phrase_infos[i].normalized.c_str(),
+                lexicon.phrase_infos[associate.index].normalized.c_str(),
+                associate.count, associate.pmi);
+      }
+    }
+    fclose(cfp);
+    fprintf(stderr, "Wrote associates from %zu co-occurring pairs "
+                    "(%" PRId64 " co-occurrences in all) to %s\n",
+            cooccurrences.NumPairs(), num_pairs, cooccur_file.c_str());
   }
-  int base_index = 0;
-  for (int i = 0; i < lexicon.phrase_infos.size(); i++) {
-    lexicon.phrase_infos[i].base_index = base_index;
-    base_index += lexicon.phrase_infos[i].forms.size();
+
+  if (!doc_freq_file.empty()) {
+    Lexicon doc_freq_lexicon = lexicon;
+    ApplyPopularityCounts(state, &doc_freq_lexicon, true);
+    FILE* dfp = fopen(doc_freq_file.c_str(), "w");
+    if (!dfp) {
+      fprintf(stderr, "Could not open %s\n", doc_freq_file.c_str());
+      return 1;
+    }
+    PrintImportances(&doc_freq_lexicon, dfp);
+    fclose(dfp);
+    fprintf(stderr, "Wrote document-frequency importances to %s\n",
+            doc_freq_file.c_str());
   }
 
-  for (const auto& phrase_info : lexicon.phrase_infos) {
-    for (const auto& form : phrase_info.forms) {
-      printf("%.1llf\t%s\n", phrase_info.importance, form.c_str());
+  if (!shard_file.empty()) {
+    if (!WritePopularityCounts(shard_file.c_str(), state)) {
+      return 1;
     }
+    fprintf(stderr, "Wrote count shard %s\n", shard_file.c_str());
+    return discover_failed ? 1 : 0;
   }
-  return 0;
+
+  ApplyPopularityCounts(state, &lexicon);
+  PrintImportances(&lexicon, stdout);
+  return discover_failed ? 1 : 0;
 }
 
@@ -1,84 +1,1237 @@
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <set>
 #include <string>
+#include <string_view>
+#include <thread>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 
+#include <errno.h>
+#include <inttypes.h>
 #include <math.h>
 #include <stdio.h>
+#include <sys/stat.h>
+#include <zlib.h>
 
+#include "lufz-bundle.h"
+#include "lufz-gzip.h"
+#include "lufz-keys.h"
+#include "lufz-reader.h"
 #include "lufz-util.h"
+#include "lufz-writer.h"
 
 using namespace std;
 
 namespace lufz {
 
+/**
+ * The sections of the output that are only written when asked for with
+ * --extra_sections, in their order in the output. Without them, the output
+ * has just the sections that older clients know about.
+ */
+const vector<string> EXTRA_SECTIONS = {
+    "indextrie", "longindex", "suffixindex", "agmindex", "phoneindex"};
+
+/**
+ * Adds count to each wildcard variant of key, in the shard of
+ * indexing_key_counts picked by its Shard().
+ */
 void AddKeyCounts(
-    const string& normalized,
+    const WildKey& key,
     int count,
-    LufzUtil* util,
-    map<string, int>* indexing_key_counts) {
-  const string key = util->Key(normalized);
-  const vector<string> key_parts = util->PartsOf(key, false);
-  int len = key_parts.size();
-  if (len > WILDIZE_ALL_BEYOND) {
-    len = WILDIZE_ALL_BEYOND;
-  }
-  for (int pattern = 0; pattern < (1 << len); pattern++) {
-    vector<string> key_variant_parts = key_parts;
-    for (int i = 0; i < len; i++) {
-      if (pattern & (1 << i)) {
-        key_variant_parts[i] = "?";
-      }
-    }
-    string key_variant = util->Join(key_variant_parts);
-    (*indexing_key_counts)[key_variant] += count;
+    vector<WildKeyMap>* indexing_key_counts) {
+  const int num_shards = indexing_key_counts->size();
+  const int num_patterns = 1 << WildKeyEncoder::NumWildizable(key);
+  for (int pattern = 0; pattern < num_patterns; pattern++) {
+    const WildKey key_variant = WildKeyEncoder::Wildize(key, pattern);
+    const int shard = num_shards == 1 ? 0 : key_variant.Shard(num_shards);
+    (*indexing_key_counts)[shard].Add(key_variant, count);
   }
 }
 
+/**
+ * indexing_keys maps each key to be indexed to 1 + its position in
+ * index->keys. The lexicon indices are written at (*next)[position], which
+ * is then advanced.
+ */
 void AddKeys(
-    const string& normalized,
-    const set<string>& indexing_keys,
+    const WildKey& key,
+    const WildKeyMap& indexing_keys,
     const vector<int>& lex_indices,
-    LufzUtil* util,
-    map<string, set<int>>* index) {
-  const string key = util->Key(normalized);
-  const vector<string> key_parts = util->PartsOf(key, false);
-  int len = key_parts.size();
-  if (len > WILDIZE_ALL_BEYOND) {
-    len = WILDIZE_ALL_BEYOND;
-  }
-  for (int pattern = 0; pattern < (1 << len); pattern++) {
-    vector<string> key_variant_parts = key_parts;
-    for (int i = 0; i < len; i++) {
-      if (pattern & (1 << i)) {
-        key_variant_parts[i] = "?";
+    vector<int64_t>* next,
+    PostingLists* index) {
+  const int num_patterns = 1 << WildKeyEncoder::NumWildizable(key);
+  for (int pattern = 0; pattern < num_patterns; pattern++) {
+    const WildKey key_variant = WildKeyEncoder::Wildize(key, pattern);
+    const int64_t pos = indexing_keys.Find(key_variant);
+    if (pos == 0) {
+      continue;
+    }
+    int64_t& n = (*next)[pos - 1];
+    for (int li : lex_indices) {
+      index->ids[n++] = li;
+    }
+  }
+}
+
+const int MIN_COUNT = 1024;
+
+/**
+ * A key that survives pruning: those with at least MIN_COUNT lexicon
+ * entries, and the all-wildcard ones.
+ */
+struct KeptKey {
+  string key_str;
+  WildKey key;
+  int64_t count;
+  int64_t start;  // Used by BuildIndexBySorting().
+};
+
+void SortKeptKeys(vector<KeptKey>* kept_keys) {
+  sort(kept_keys->begin(), kept_keys->end(),
+       [](const KeptKey& a, const KeptKey& b) {
+         return a.key_str < b.key_str;
+       });
+}
+
+/**
+ * Returns the first phrase of the thread-th of num_threads contiguous
+ * ranges of num_phrases phrases (the range ends where the next one starts).
+ * The threads in the passes below (see RunOnThreads()) always work on
+ * disjoint parts of the output and visit phrases in order, so the output
+ * does not depend on the number of threads.
+ */
+int PhraseRangeStart(int num_phrases, int thread, int num_threads) {
+  return int64_t(num_phrases) * thread / num_threads;
+}
+
+/**
+ * Sets (*shards)[s] to the form indices of the phrases that are in shard s,
+ * in order, where shards_of(i, add) calls add(s) for each shard s of phrase
+ * i. Each thread collects the forms of a range of phrases, split up by
+ * shard, and then thread t concatenates the parts of the shards s with
+ * s % num_threads == t, in the order of the ranges.
+ */
+template <typename F>
+void CollectShardForms(const Lexicon& lexicon, F shards_of, int num_threads,
+                       vector<vector<int>>* shards) {
+  const int num_phrases = lexicon.phrase_infos.size();
+  const int num_shards = shards->size();
+  vector<vector<vector<int>>> range_shards(
+      num_threads, vector<vector<int>>(num_shards));
+  RunOnThreads(num_threads, [&](int t) {
+    vector<vector<int>>& parts = range_shards[t];
+    const int end = PhraseRangeStart(num_phrases, t + 1, num_threads);
+    for (int i = PhraseRangeStart(num_phrases, t, num_threads); i < end;
+         ++i) {
+      const PhraseInfo& phrase_info = lexicon.phrase_infos[i];
+      shards_of(i, [&](int s) {
+        for (size_t j = 0; j < phrase_info.forms.size(); ++j) {
+          parts[s].push_back(phrase_info.base_index + j);
+        }
+      });
+    }
+  });
+  RunOnThreads(num_threads, [&](int t) {
+    for (int s = t; s < num_shards; s += num_threads) {
+      vector<int>& shard = (*shards)[s];
+      for (int r = 0; r < num_threads; ++r) {
+        vector<int>& part = range_shards[r][s];
+        shard.insert(shard.end(), part.begin(), part.end());
+        vector<int>().swap(part);
       }
     }
-    string key_variant = util->Join(key_variant_parts);
-    if (indexing_keys.count(key_variant) == 0) {
+  });
+}
+
+/**
+ * Builds the index in two passes over the wildcard variants of keys: the
+ * first pass counts them (to decide which keys to keep) and the second one
+ * fills in the posting lists of the kept keys. Phrases whose keys have
+ * fewer than min_length letters are left out. Each thread handles one
+ * contiguous range of phrases in both passes, so no phrase is expanded
+ * twice in a pass.
+ */
+bool BuildIndexByCounting(
+    const Lexicon& lexicon,
+    const vector<WildKey>& keys,
+    const WildKeyEncoder& key_encoder,
+    int min_length,
+    int num_threads,
+    PostingLists* index) {
+  const int num_phrases = lexicon.phrase_infos.size();
+  /**
+   * First, do a pass to decide which indexing keys to keep. This is
+   * much faster than building the full index and then pruning
+   * away keys that do not have many entries. range_counts[r][s] has the
+   * counts of the keys in shard s from the phrases in range r.
+   */
+  vector<vector<WildKeyMap>> range_counts(
+      num_threads, vector<WildKeyMap>(num_threads));
+  fprintf(stderr, "Computing indexing_key_counts...\n");
+  RunOnThreads(num_threads, [&](int t) {
+    const int end = PhraseRangeStart(num_phrases, t + 1, num_threads);
+    for (int i = PhraseRangeStart(num_phrases, t, num_threads); i < end;
+         ++i) {
+      const PhraseInfo& phrase_info = lexicon.phrase_infos[i];
+      const string& normalized = phrase_info.normalized;
+      if (normalized.empty() || keys[i].Length() < min_length) continue;
+      int count = phrase_info.forms.size();
+      AddKeyCounts(keys[i], count, &range_counts[t]);
+      if (t == 0 && i > 0 && i % 1000 == 0) {
+        fprintf(stderr, "Indexing key counts at %d: %s\n", i, normalized.c_str());
+      }
+    }
+  });
+  /**
+   * Thread s sums up the counts of the keys of shard s over all the ranges
+   * into range_counts[0][s] (so that each key then gets visited once, rather
+   * than looked up in every range), and filters them. The counts of the
+   * other ranges are kept, as they give where each range starts writing in
+   * each posting list in the second pass.
+   */
+  vector<vector<KeptKey>> kept_key_shards(num_threads);
+  vector<int64_t> num_indexing_keys(num_threads, 0);
+  RunOnThreads(num_threads, [&](int s) {
+    WildKeyMap& totals = range_counts[0][s];
+    for (int r = 1; r < num_threads; ++r) {
+      range_counts[r][s].ForEach([&totals](const WildKey& key, int64_t count) {
+        totals.Add(key, count);
+      });
+    }
+    num_indexing_keys[s] = totals.Size();
+    totals.ForEach([&](const WildKey& key, int64_t count) {
+      if (count < MIN_COUNT && !WildKeyEncoder::AllWild(key)) {
+        return;
+      }
+      kept_key_shards[s].push_back({"", key, count, 0});
+    });
+  });
+  int64_t total_indexing_keys = 0;
+  for (int64_t n : num_indexing_keys) {
+    total_indexing_keys += n;
+  }
+  fprintf(stderr, "Pre-filtering, index has size: %" PRId64 "\n",
+          total_indexing_keys);
+  // Filter, and only then convert the keys to strings.
+  vector<KeptKey> kept_keys;
+  for (vector<KeptKey>& shard : kept_key_shards) {
+    for (KeptKey& kept_key : shard) {
+      kept_key.key_str = key_encoder.ToString(kept_key.key);
+      kept_keys.push_back(move(kept_key));
+    }
+  }
+  kept_key_shards.clear();
+  SortKeptKeys(&kept_keys);
+  /**
+   * The counts tell us exactly how many lexicon indices each kept key will
+   * have, so the index is laid out up front. Within the posting list of
+   * each key, range r starts writing at next_ids[r], after the lexicon
+   * indices of the earlier ranges: those that are not from ranges r and
+   * later (whose counts are still in range_counts).
+   */
+  WildKeyMap indexing_keys;
+  vector<vector<int64_t>> next_ids(num_threads);
+  index->offsets.assign(1, 0);
+  for (size_t ki = 0; ki < kept_keys.size(); ++ki) {
+    const KeptKey& kept_key = kept_keys[ki];
+    if (ki % 1000 == 0) {
+      fprintf(stderr, "Indexing key #%zu: [%s] = %" PRId64 "\n", ki,
+              kept_key.key_str.c_str(), kept_key.count);
+    }
+    indexing_keys.Add(kept_key.key, ki + 1);
+    index->keys.push_back(kept_key.key_str);
+    const int shard = kept_key.key.Shard(num_threads);
+    int64_t next = index->offsets.back() + kept_key.count;
+    for (int r = num_threads - 1; r > 0; --r) {
+      next -= range_counts[r][shard].Find(kept_key.key);
+      next_ids[r].push_back(next);
+    }
+    next_ids[0].push_back(index->offsets.back());
+    index->offsets.push_back(index->offsets.back() + kept_key.count);
+  }
+  kept_keys.clear();
+  range_counts.clear();
+  index->ids.resize(index->offsets.back());
+  fprintf(stderr, "Post-filtering, index has size: %zu\n", index->NumKeys());
+
+  fprintf(stderr, "Building index...\n");
+  const vector<vector<int64_t>> range_starts = next_ids;
+  RunOnThreads(num_threads, [&](int t) {
+    vector<int> lex_indices;
+    const int end = PhraseRangeStart(num_phrases, t + 1, num_threads);
+    for (int i = PhraseRangeStart(num_phrases, t, num_threads); i < end;
+         ++i) {
+      const PhraseInfo& phrase_info = lexicon.phrase_infos[i];
+      const string& normalized = phrase_info.normalized;
+      if (normalized.empty() || keys[i].Length() < min_length) continue;
+      lex_indices.clear();
+      for (size_t j = 0; j < phrase_info.forms.size(); ++j) {
+        lex_indices.push_back(phrase_info.base_index + j);
+      }
+      AddKeys(keys[i], indexing_keys, lex_indices, &next_ids[t], index);
+      if (t == 0 && i > 0 && i % 1000 == 0) {
+        fprintf(stderr, "Indexed at %d: %s\n", i, normalized.c_str());
+      }
+    }
+  });
+
+  // Phrases are visited in order of base_index, so each list of lexicon
+  // indices is already sorted, and has no duplicates. Each range must have
+  // ended where the next one started.
+  for (size_t ki = 0; ki < index->NumKeys(); ++ki) {
+    bool filled = true;
+    for (int r = 0; r < num_threads; ++r) {
+      filled = filled && next_ids[r][ki] == (r + 1 < num_threads ?
+          range_starts[r + 1][ki] : index->offsets[ki + 1]);
+    }
+    if (!filled ||
+        !is_sorted(index->Begin(ki), index->End(ki))) {
+      fprintf(stderr, "Hmm. Bad list of lexicon indices for key [%s]\n",
+              index->keys[ki].c_str());
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * Builds the index in a single pass over the wildcard variants of keys:
+ * (key, phrase) pairs are generated once and sorted by key (spilling
+ * sorted runs to disk if there are more than max_buffered of them). Each
+ * run of pairs with the same key then gives both its count (for pruning)
+ * and its posting list. Phrases whose keys have fewer than min_length
+ * letters are left out.
+ */
+bool BuildIndexBySorting(
+    const Lexicon& lexicon,
+    const vector<WildKey>& keys,
+    const WildKeyEncoder& key_encoder,
+    int min_length,
+    size_t max_buffered,
+    int num_threads,
+    PostingLists* index) {
+  const int num_phrases = lexicon.phrase_infos.size();
+  fprintf(stderr, "Generating (key, phrase) pairs...\n");
+  KeyPhraseSorter sorter(max_buffered, num_threads);
+  for (int i = 0; i < num_phrases; ++i) {
+    if (lexicon.phrase_infos[i].normalized.empty() ||
+        keys[i].Length() < min_length) {
       continue;
     }
-    for (int li : lex_indices) {
-      if ((*index)[key_variant].count(li) > 0) {
-        fprintf(stderr, "Hmm. For normalized=[%s], key=[%s], key_variant=[%s], we already have index %d\n",
-                normalized.c_str(), key.c_str(), key_variant.c_str(), li);
+    const int num_patterns = 1 << WildKeyEncoder::NumWildizable(keys[i]);
+    for (int pattern = 0; pattern < num_patterns; pattern++) {
+      if (!sorter.Add(KeyPhrase::Make(
+              WildKeyEncoder::Wildize(keys[i], pattern), i))) {
+        return false;
       }
-      (*index)[key_variant].insert(li);
     }
   }
+  if (!sorter.Finish()) {
+    return false;
+  }
+  fprintf(stderr, "Sorted %" PRId64 " (key, phrase) pairs, %d spilled runs\n",
+          sorter.NumPairs(), sorter.NumSpilledRuns());
+
+  // Pairs with equal keys come in the order of phrases, so the lexicon
+  // indices in each run are sorted.
+  vector<KeptKey> kept_keys;
+  vector<int32_t> ids;
+  int64_t num_indexing_keys = 0;
+  KeyPhrase pair;
+  bool more = sorter.Next(&pair);
+  while (more) {
+    const KeyPhrase first = pair;
+    const int64_t start = ids.size();
+    int64_t count = 0;
+    do {
+      const PhraseInfo& phrase_info = lexicon.phrase_infos[pair.phrase];
+      for (size_t j = 0; j < phrase_info.forms.size(); ++j) {
+        ids.push_back(phrase_info.base_index + j);
+      }
+      count += phrase_info.forms.size();
+      more = sorter.Next(&pair);
+    } while (more && pair.SameKey(first));
+    ++num_indexing_keys;
+    const WildKey key = first.Key();
+    if (count < MIN_COUNT && !WildKeyEncoder::AllWild(key)) {
+      ids.resize(start);
+      continue;
+    }
+    kept_keys.push_back({key_encoder.ToString(key), key, count, start});
+  }
+  if (sorter.Failed()) {
+    return false;
+  }
+  fprintf(stderr, "Pre-filtering, index has size: %" PRId64 "\n",
+          num_indexing_keys);
+  SortKeptKeys(&kept_keys);
+  index->offsets.assign(1, 0);
+  index->ids.reserve(ids.size());
+  for (const KeptKey& kept_key : kept_keys) {
+    index->keys.push_back(kept_key.key_str);
+    index->ids.insert(index->ids.end(), ids.begin() + kept_key.start,
+                      ids.begin() + kept_key.start + kept_key.count);
+    index->offsets.push_back(index->ids.size());
+  }
+  fprintf(stderr, "Post-filtering, index has size: %zu\n", index->NumKeys());
+  return true;
 }
 
-void AddAgmKey(
-    const string& normalized,
-    const vector<int>& lex_indices,
+/**
+ * Builds an exact index from key_phrases, which has a (key, phrase index)
+ * pair for each key of each phrase: each distinct key gets the sorted
+ * lexicon indices of all the forms of its phrases. The keys are sorted.
+ */
+void BuildExactIndex(
+    const Lexicon& lexicon,
+    vector<pair<string, int>>* key_phrases,
+    PostingLists* index) {
+  sort(key_phrases->begin(), key_phrases->end());
+  key_phrases->erase(unique(key_phrases->begin(), key_phrases->end()),
+                     key_phrases->end());
+  index->keys.clear();
+  index->ids.clear();
+  index->offsets.assign(1, 0);
+  for (size_t i = 0; i < key_phrases->size(); ++i) {
+    const auto& key_phrase = (*key_phrases)[i];
+    if (i == 0 || key_phrase.first != (*key_phrases)[i - 1].first) {
+      if (i > 0) {
+        index->offsets.push_back(index->ids.size());
+      }
+      index->keys.push_back(key_phrase.first);
+    }
+    const PhraseInfo& phrase_info = lexicon.phrase_infos[key_phrase.second];
+    for (size_t j = 0; j < phrase_info.forms.size(); ++j) {
+      index->ids.push_back(phrase_info.base_index + j);
+    }
+  }
+  if (!key_phrases->empty()) {
+    index->offsets.push_back(index->ids.size());
+  }
+}
+
+/**
+ * Builds the positional index for long phrases (those with more than
+ * WILDIZE_ALL_BEYOND letters, whose keys have only wildcards after that):
+ * for each length, position and letter, the key with just that letter at
+ * that position (such as "???A???????????") gets the long phrases that
+ * have that letter there. long_letters has the letters of each long phrase
+ * (and is empty for others), and is cleared. Reports, for each length, how
+ * much smaller the positional lists are than the all-wildcard bucket that
+ * the main index has for that length.
+ */
+void BuildLongIndex(const Lexicon& lexicon,
+                    vector<vector<string>>* long_letters,
+                    PostingLists* long_index) {
+  vector<pair<string, int>> key_phrases;
+  map<int, int64_t> num_entries_by_len;
+  for (size_t i = 0; i < long_letters->size(); ++i) {
+    const vector<string>& letters = (*long_letters)[i];
+    if (letters.empty()) continue;
+    num_entries_by_len[letters.size()] +=
+        lexicon.phrase_infos[i].forms.size();
+    for (size_t pos = 0; pos < letters.size(); ++pos) {
+      string key;
+      for (size_t j = 0; j < letters.size(); ++j) {
+        key += (j == pos) ? letters[j] : "?";
+      }
+      key_phrases.emplace_back(std::move(key), i);
+    }
+  }
+  long_letters->clear();
+  BuildExactIndex(lexicon, &key_phrases, long_index);
+
+  map<int, pair<int64_t, int64_t>> lists_by_len;  // #keys, largest list.
+  for (size_t ki = 0; ki < long_index->NumKeys(); ++ki) {
+    // All but one of the letters of a key are wildcards.
+    const string& key = long_index->keys[ki];
+    const int len = count(key.begin(), key.end(), '?') + 1;
+    auto& lists = lists_by_len[len];
+    lists.first++;
+    lists.second = max(lists.second, long_index->Size(ki));
+  }
+  for (const auto& entries : num_entries_by_len) {
+    const auto& lists = lists_by_len[entries.first];
+    fprintf(stderr, "long-index len:%d #entries: %" PRId64 " #keys: %" PRId64
+                    " max-entries-for-a-key: %" PRId64 "\n",
+            entries.first, entries.second, lists.first, lists.second);
+  }
+  fprintf(stderr, "Total# long-index keys: %zu, #entries: %" PRId64 "\n",
+          long_index->NumKeys(), int64_t(long_index->ids.size()));
+}
+
+const int MAX_SUFFIX_QUERY_LETTERS = 3;
+
+/**
+ * Reports, for each length beyond WILDIZE_ALL_BEYOND, the sizes of the
+ * buckets that suffix queries (a long phrase with just its last k letters
+ * known, for k up to MAX_SUFFIX_QUERY_LETTERS) get. Without the suffix
+ * index, the main index only has the all-wildcard bucket of that length
+ * for them. With it, a query can use the smallest list among the kept
+ * keys that have some of its k letters. suffix_keys are the keys of the
+ * phrases over their reversed letters, and reversed_index is the index
+ * built from them (before ReverseSuffixKeys()).
+ */
+void ReportSuffixBuckets(const Lexicon& lexicon,
+                         const vector<WildKey>& suffix_keys,
+                         const WildKeyEncoder& key_encoder,
+                         const PostingLists& reversed_index) {
+  unordered_map<string, int64_t> bucket_sizes;
+  for (size_t ki = 0; ki < reversed_index.NumKeys(); ++ki) {
+    bucket_sizes[reversed_index.keys[ki]] = reversed_index.Size(ki);
+  }
+  // By length, then by the number of known letters (0 for the all-wildcard
+  // bucket): the bucket of each phrase.
+  map<int, vector<vector<int64_t>>> buckets_by_len;
+  for (size_t i = 0; i < suffix_keys.size(); ++i) {
+    const WildKey& key = suffix_keys[i];
+    if (lexicon.phrase_infos[i].normalized.empty() ||
+        key.Length() <= WILDIZE_ALL_BEYOND) {
+      continue;
+    }
+    auto& buckets = buckets_by_len[key.Length()];
+    buckets.resize(MAX_SUFFIX_QUERY_LETTERS + 1);
+    const int all_wild = (1 << WildKeyEncoder::NumWildizable(key)) - 1;
+    const int64_t all_wild_size = bucket_sizes[key_encoder.ToString(
+        WildKeyEncoder::Wildize(key, all_wild))];
+    buckets[0].push_back(all_wild_size);
+    for (int k = 1; k <= MAX_SUFFIX_QUERY_LETTERS; ++k) {
+      const int known = (1 << k) - 1;
+      int64_t smallest = all_wild_size;
+      for (int letters = known; letters > 0; letters = (letters - 1) & known) {
+        const auto it = bucket_sizes.find(key_encoder.ToString(
+            WildKeyEncoder::Wildize(key, all_wild & ~letters)));
+        if (it != bucket_sizes.end()) {
+          smallest = min(smallest, it->second);
+        }
+      }
+      buckets[k].push_back(smallest);
+    }
+  }
+  for (auto& len_buckets : buckets_by_len) {
+    auto& buckets = len_buckets.second;
+    const int n = buckets[0].size();
+    string after;
+    for (int k = 1; k <= MAX_SUFFIX_QUERY_LETTERS; ++k) {
+      sort(buckets[k].begin(), buckets[k].end());
+      after += " " + to_string(buckets[k][n / 2]) + "/" +
+               to_string(buckets[k][n * 9 / 10]) + "/" +
+               to_string(buckets[k][n - 1]);
+    }
+    fprintf(stderr, "suffix-query len:%d #phrases: %d before: %" PRId64 " "
+                    "after (p50/p90/max, for 1..%d known letters):%s\n",
+            len_buckets.first, n, buckets[0][0], MAX_SUFFIX_QUERY_LETTERS,
+            after.c_str());
+  }
+}
+
+/**
+ * Sets suffix_index to reversed_index (built over keys of reversed
+ * letters) with its keys turned back around (such as "?????????NESS"),
+ * in sorted order. The all-wildcard keys are left out, as the main index
+ * has them too.
+ */
+void ReverseSuffixKeys(LufzUtil* util,
+                       const PostingLists& reversed_index,
+                       PostingLists* suffix_index) {
+  vector<pair<string, int>> keys;
+  for (size_t ki = 0; ki < reversed_index.NumKeys(); ++ki) {
+    const string& key = reversed_index.keys[ki];
+    if (util->AllWild(key)) continue;
+    vector<string> parts = util->PartsOf(key, false);
+    reverse(parts.begin(), parts.end());
+    keys.emplace_back(util->Join(parts), ki);
+  }
+  sort(keys.begin(), keys.end());
+  suffix_index->keys.clear();
+  suffix_index->ids.clear();
+  suffix_index->offsets.assign(1, 0);
+  for (const auto& key : keys) {
+    suffix_index->keys.push_back(key.first);
+    suffix_index->ids.insert(suffix_index->ids.end(),
+                             reversed_index.Begin(key.second),
+                             reversed_index.End(key.second));
+    suffix_index->offsets.push_back(suffix_index->ids.size());
+  }
+  fprintf(stderr, "Total# suffix-index keys: %zu, #entries: %" PRId64 "\n",
+          suffix_index->NumKeys(), int64_t(suffix_index->ids.size()));
+}
+
+/**
+ * Assigns IDs to phonemes, in sorted order of the phonemes, so that a
+ * pronunciation can be packed into a string of IDs (two bytes each,
+ * big-endian) that sorts like the pronunciation itself.
+ */
+class PhonemeIds {
+ public:
+  explicit PhonemeIds(const Lexicon& lexicon) {
+    set<string> phonemes;
+    for (const PhraseInfo& phrase_info : lexicon.phrase_infos) {
+      for (const vector<string>& phone : phrase_info.phones) {
+        phonemes.insert(phone.begin(), phone.end());
+      }
+    }
+    phonemes_.assign(phonemes.begin(), phonemes.end());
+    for (size_t id = 0; id < phonemes_.size(); ++id) {
+      ids_[phonemes_[id]] = id;
+    }
+  }
+
+  int NumPhonemes() const {
+    return phonemes_.size();
+  }
+  const vector<string>& Phonemes() const {
+    return phonemes_;
+  }
+  int Id(const string& phoneme) const {
+    return ids_.at(phoneme);
+  }
+
+  string Pack(const vector<string>& phone) const {
+    string packed;
+    for (const string& phoneme : phone) {
+      const int id = ids_.at(phoneme);
+      packed += char(id >> 8);
+      packed += char(id & 0xff);
+    }
+    return packed;
+  }
+
+  /**
+   * The canonical form of a packed pronunciation: its phonemes, separated
+   * by spaces.
+   */
+  string Unpack(const string& packed) const {
+    string phone;
+    for (size_t i = 0; i + 1 < packed.size(); i += 2) {
+      if (i > 0) phone += ' ';
+      phone += phonemes_[(uint8_t(packed[i]) << 8) | uint8_t(packed[i + 1])];
+    }
+    return phone;
+  }
+
+ private:
+  vector<string> phonemes_;  // By ID.
+  unordered_map<string, int> ids_;
+};
+
+/**
+ * Writes a sorted list of lexicon indices as a JSON array (starting at the
+ * current position, continuing on lines starting with indent, with 100
+ * indices per line). With vlq, writes it as a JSON string of base64
+ * digits instead (see OutputWriter::AppendVlq()), which the JavaScript in
+ * VLQ_DECODER decodes.
+ */
+template <typename Iter>
+void WriteIds(Iter begin, Iter end, const string& indent, bool vlq,
+              OutputWriter* out) {
+  if (vlq) {
+    out->Append('"');
+    out->AppendVlq(begin, end);
+    out->Append('"');
+    return;
+  }
+  out->Append("[\n");
+  out->Append(indent);
+  out->Append("  ");
+  int counter = 0;
+  for (Iter it = begin; it != end; ++it) {
+    if (counter > 0) {
+      out->Append(',');
+      if (counter % 100 == 0) {
+        out->Append('\n');
+        out->Append(indent);
+        out->Append("  ");
+      }
+    }
+    counter++;
+    out->AppendInt(*it);
+  }
+  out->Append('\n');
+  out->Append(indent);
+  out->Append(']');
+}
+
+/**
+ * Decodes the lists of lexicon indices written by WriteIds() with vlq, in
+ * place, so that exetLexicon ends up just as it would without vlq.
+ */
+const char VLQ_DECODER[] = R"(
+(function() {
+  const digits =
+      'ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/';
+  const values = new Int8Array(128);
+  for (let i = 0; i < 64; i++) values[digits.charCodeAt(i)] = i;
+  function decode(s) {
+    const ids = [];
+    let last = 0, delta = 0, scale = 1;
+    for (let i = 0; i < s.length; i++) {
+      const v = values[s.charCodeAt(i)];
+      delta += (v & 31) * scale;
+      if (v & 32) {
+        scale *= 32;
+      } else {
+        last += delta;
+        ids.push(last);
+        delta = 0;
+        scale = 1;
+      }
+    }
+    return ids;
+  }
+  function decodeAll(lists) {
+    for (const k in lists) lists[k] = decode(lists[k]);
+  }
+  // The sections of --extra_sections may be absent.
+  function decodeKeys(section) {
+    if (section) decodeAll(section.keys);
+  }
+  decodeAll(exetLexicon.index);
+  decodeKeys(exetLexicon.longindex);
+  decodeKeys(exetLexicon.suffixindex);
+  decodeAll(exetLexicon.anagrams);
+  decodeKeys(exetLexicon.agmindex);
+  decodeAll(exetLexicon.phindex);
+  decodeKeys(exetLexicon.phoneindex);
+})();
+)";
+
+/**
+ * Writes the entries of index for the keys at key_indices as those of a
+ * JSON object (without the enclosing braces), each key on a line starting
+ * with indent, followed by its lexicon indices (see WriteIds()).
+ */
+void WritePostingLists(const PostingLists& index,
+                       const vector<int>& key_indices, const string& indent,
+                       bool vlq, OutputWriter* out) {
+  for (size_t i = 0; i < key_indices.size(); ++i) {
+    const int ki = key_indices[i];
+    out->Append(indent);
+    out->Append('"');
+    out->Append(index.keys[ki]);
+    out->Append("\": ");
+    WriteIds(index.Begin(ki), index.End(ki), indent, vlq, out);
+    if (i + 1 < key_indices.size()) {
+      out->Append(',');
+    }
+    out->Append('\n');
+  }
+}
+
+void WritePostingLists(const PostingLists& index, const string& indent,
+                       bool vlq, OutputWriter* out) {
+  vector<int> key_indices(index.NumKeys());
+  for (size_t ki = 0; ki < index.NumKeys(); ++ki) {
+    key_indices[ki] = ki;
+  }
+  WritePostingLists(index, key_indices, indent, vlq, out);
+}
+
+/**
+ * Writes the entries of a sharded index (such as "anagrams") as those of
+ * a JSON array (without the enclosing brackets), with the lexicon indices
+ * of each shard written by WriteIds().
+ */
+template <typename Shard>
+void WriteShards(const vector<Shard>& shards, bool vlq, OutputWriter* out) {
+  const string indent = "    ";
+  for (size_t s = 0; s < shards.size(); ++s) {
+    out->Append(indent);
+    WriteIds(shards[s].begin(), shards[s].end(), indent, vlq, out);
+    if (s + 1 < shards.size()) {
+      out->Append(',');
+    }
+    out->Append('\n');
+  }
+}
+
+/**
+ * Writes the letters of lexicon as JSON strings, separated by commas.
+ * The strings are escaped for a template literal if in_template.
+ */
+void WriteLetters(const Lexicon& lexicon, bool in_template,
+                  OutputWriter* out) {
+  int letters_i = 0;
+  for (const string& letter : lexicon.letters) {
+    if (letters_i > 0) out->Append(", ");
+    ++letters_i;
+    out->Append('"');
+    out->Append(OutputWriter::EscapeJson(letter, in_template));
+    out->Append('"');
+  }
+}
+
+/**
+ * Writes all the forms in lexicon as JSON strings, separated by commas,
+ * 100 per line.
+ */
+void WriteForms(const Lexicon& lexicon, bool in_template, OutputWriter* out) {
+  int lnum = 0;
+  for (const PhraseInfo& phrase_info : lexicon.phrase_infos) {
+    for (const string& form : phrase_info.forms) {
+      if (lnum > 0) {
+        out->Append(',');
+        if (lnum % 100 == 0) out->Append("\n    ");
+      }
+      out->Append('"');
+      out->Append(OutputWriter::EscapeJson(form, in_template));
+      out->Append('"');
+      lnum++;
+    }
+  }
+}
+
+/**
+ * Writes the pronunciations of all the forms in lexicon (each as a JSON
+ * array of arrays of phonemes), separated by commas, 100 per line.
+ */
+void WritePhones(const Lexicon& lexicon, bool in_template, OutputWriter* out) {
+  int lnum = 0;
+  string phones;
+  for (const PhraseInfo& phrase_info : lexicon.phrase_infos) {
+    // All the forms of a phrase have the same phones.
+    phones = "[";
+    int j = 0;
+    for (const vector<string>& phone : phrase_info.phones) {
+      if (j > 0) phones += ",";
+      j++;
+      phones += "[";
+      for (size_t k = 0; k < phone.size(); k++) {
+        if (k > 0) phones += ",";
+        phones += "\"";
+        phones += OutputWriter::EscapeJson(phone[k], in_template);
+        phones += "\"";
+      }
+      phones += "]";
+    }
+    phones += "]";
+    for (size_t j = 0; j < phrase_info.forms.size(); ++j) {
+      if (lnum > 0) {
+        out->Append(',');
+        if (lnum % 100 == 0) out->Append("\n    ");
+      }
+      lnum++;
+      out->Append(phones);
+    }
+  }
+}
+
+/**
+ * Adds a PostingLists to bundle as the arrays <name>.keys.bytes,
+ * <name>.keys.offsets, <name>.offsets and <name>.ids.
+ */
+bool AddPostingListsToBundle(const string& name, const PostingLists& index,
+                             BundleWriter* bundle) {
+  if (index.ids.size() > UINT32_MAX) {
+    fprintf(stderr, "Too many lexicon indices in %s for a bundle\n",
+            name.c_str());
+    return false;
+  }
+  bundle->AddStrings(name + ".keys", index.keys);
+  bundle->AddUint32(name + ".offsets", vector<uint32_t>(
+      index.offsets.begin(), index.offsets.end()));
+  bundle->AddInt32(name + ".ids", index.ids);
+  return true;
+}
+
+/**
+ * Adds a sharded index to bundle as the arrays <name>.offsets and
+ * <name>.ids.
+ */
+template <typename Shard>
+void AddShardsToBundle(const string& name, const vector<Shard>& shards,
+                       BundleWriter* bundle) {
+  vector<uint32_t> offsets(1, 0);
+  vector<int32_t> ids;
+  for (const Shard& shard : shards) {
+    ids.insert(ids.end(), shard.begin(), shard.end());
+    offsets.push_back(ids.size());
+  }
+  bundle->AddUint32(name + ".offsets", offsets);
+  bundle->AddInt32(name + ".ids", ids);
+}
+
+/**
+ * Writes the same contents as the JavaScript output, as a binary bundle
+ * (see lufz-bundle.h and lufz-lexicon-bundle.js):
+ *   lexicon.bytes, lexicon.offsets: the lexicon, as a string table.
+ *   index.*, longindex.*, suffixindex.*, agmindex.*, phoneindex.*: keys
+ *     (as a string table), offsets and lexicon indices of the exact
+ *     indices (other than index, only those in extra_sections).
+ *   anagrams.*, phindex.*: offsets and lexicon indices of the shards.
+ *   phones.offsets: for each lexicon entry, the range of its
+ *     pronunciations in phones.pronOffsets, which gives the range of
+ *     each pronunciation in phones.ids (phoneme IDs, indexing the
+ *     "phonemes" header field).
+ */
+bool WriteBundle(
+    const string& file,
     LufzUtil* util,
-    vector<vector<int>>* agm_shards) {
-  string key = util->AgmKey(normalized);
-  int shard = util->IndexShard(key, AGM_INDEX_SHARDS);
-  for (int li : lex_indices) {
-    (*agm_shards)[shard].push_back(li);
+    const Lexicon& lexicon,
+    const PostingLists& index,
+    const PostingLists& long_index,
+    const PostingLists& suffix_index,
+    const vector<vector<int>>& agm_shards,
+    const PostingLists& agm_index,
+    const PhonemeIds& phoneme_ids,
+    const vector<set<int>>& phone_shards,
+    const PostingLists& phone_index,
+    const set<string>& extra_sections) {
+  BundleWriter bundle;
+  bundle.SetString("id", "Lufz-" + util->Language() + "-" + VERSION);
+  bundle.SetString("language", util->Language());
+  bundle.SetString("script", util->Script());
+  bundle.SetStrings("letters", vector<string>(lexicon.letters.begin(),
+                                              lexicon.letters.end()));
+  bundle.SetStrings("phonemes", phoneme_ids.Phonemes());
+
+  vector<string> forms;
+  vector<uint32_t> phones_offsets(1, 0);
+  vector<uint32_t> pron_offsets(1, 0);
+  vector<uint16_t> phone_ids;
+  for (const PhraseInfo& phrase_info : lexicon.phrase_infos) {
+    for (const string& form : phrase_info.forms) {
+      forms.push_back(form);
+      for (const vector<string>& phone : phrase_info.phones) {
+        for (const string& phoneme : phone) {
+          phone_ids.push_back(phoneme_ids.Id(phoneme));
+        }
+        pron_offsets.push_back(phone_ids.size());
+      }
+      phones_offsets.push_back(pron_offsets.size() - 1);
+    }
   }
+  bundle.AddStrings("lexicon", forms);
+  forms.clear();
+  auto add_extra = [&extra_sections, &bundle](const string& name,
+                                              const PostingLists& index) {
+    return extra_sections.count(name) == 0 ||
+           AddPostingListsToBundle(name, index, &bundle);
+  };
+  if (!AddPostingListsToBundle("index", index, &bundle) ||
+      !add_extra("longindex", long_index) ||
+      !add_extra("suffixindex", suffix_index)) {
+    return false;
+  }
+  AddShardsToBundle("anagrams", agm_shards, &bundle);
+  if (!add_extra("agmindex", agm_index)) {
+    return false;
+  }
+  bundle.AddUint32("phones.offsets", phones_offsets);
+  bundle.AddUint32("phones.pronOffsets", pron_offsets);
+  bundle.AddUint16("phones.ids", phone_ids);
+  AddShardsToBundle("phindex", phone_shards, &bundle);
+  if (!add_extra("phoneindex", phone_index)) {
+    return false;
+  }
+  if (!bundle.Write(file)) {
+    return false;
+  }
+  fprintf(stderr, "Wrote bundle %s with %" PRId64 " bytes of arrays\n",
+          file.c_str(), bundle.NumArrayBytes());
+  return true;
+}
+
+/**
+ * A trie of the indexing keys of each length, without their trailing
+ * wildcards. Wildcarding a letter of a key can only add to its lexicon
+ * entries, so all the keys that a client would try in turn for a pattern
+ * (replacing its last known letter by "?" until a key is found) that are
+ * present come first. Walking the pattern down this trie (through the
+ * child for its letter, or for "?", at each position, and stopping where
+ * there is none) thus finds the most specific key in one pass: it is the
+ * pattern up to its last known letter on the walk, followed by wildcards.
+ */
+class KeyTrie {
+ public:
+  KeyTrie() : nodes_(1) {}
+
+  void Add(const vector<string>& key_parts) {
+    int len = key_parts.size();
+    while (len > 0 && key_parts[len - 1] == "?") --len;
+    int node = 0;
+    for (int i = 0; i < len; ++i) {
+      auto it = nodes_[node].find(key_parts[i]);
+      if (it != nodes_[node].end()) {
+        node = it->second;
+        continue;
+      }
+      const int child = nodes_.size();
+      nodes_[node][key_parts[i]] = child;
+      nodes_.emplace_back();
+      node = child;
+    }
+  }
+
+  int NumNodes() const {
+    return nodes_.size();
+  }
+
+  /**
+   * Writes the trie as nested JSON objects, mapping letters (and "?") to
+   * children.
+   */
+  void Write(OutputWriter* out, int node = 0) const {
+    out->Append('{');
+    bool first = true;
+    for (const auto& child : nodes_[node]) {
+      if (!first) out->Append(',');
+      first = false;
+      out->Append('"');
+      out->Append(child.first);
+      out->Append("\":");
+      Write(out, child.second);
+    }
+    out->Append('}');
+  }
+
+ private:
+  vector<map<string, int>> nodes_;  // Children, by letter.
+};
+
+/**
+ * Builds a KeyTrie for each key length in index.
+ */
+map<int, KeyTrie> BuildKeyTries(LufzUtil* util, const PostingLists& index) {
+  map<int, KeyTrie> tries;
+  for (const string& key : index.keys) {
+    const vector<string> parts = util->PartsOf(key, false);
+    tries[parts.size()].Add(parts);
+  }
+  return tries;
+}
+
+/**
+ * Writes the entries (without the enclosing braces) of the JSON object
+ * that maps each key length to its trie, one per line.
+ */
+void WriteKeyTries(const map<int, KeyTrie>& tries, const string& indent,
+                   OutputWriter* out) {
+  size_t i = 0;
+  for (const auto& trie : tries) {
+    out->Append(indent);
+    out->Append('"');
+    out->AppendInt(trie.first);
+    out->Append("\": ");
+    trie.second.Write(out);
+    if (++i < tries.size()) {
+      out->Append(',');
+    }
+    out->Append('\n');
+  }
+}
+
+/**
+ * A file written by WriteSplitOutput(), as listed in its manifest.
+ */
+struct SplitFile {
+  string section;
+  int key_length;  // For files partitioned by key length, else 0.
+  string file;
+  int64_t bytes;
+};
+
+/**
+ * Writes dir/name (through write()), and adds it to files.
+ */
+bool WriteSplitFile(const string& dir, const string& section, int key_length,
+                    const string& name,
+                    const function<void(OutputWriter*)>& write,
+                    vector<SplitFile>* files) {
+  const string path = dir + "/" + name;
+  FILE* fp = fopen(path.c_str(), "w");
+  if (!fp) {
+    fprintf(stderr, "Could not open %s for writing\n", path.c_str());
+    return false;
+  }
+  bool ok;
+  int64_t bytes;
+  {
+    OutputWriter out(fp);
+    write(&out);
+    ok = out.Flush();
+    bytes = out.NumBytes();
+  }
+  if (fclose(fp) != 0 || !ok) {
+    fprintf(stderr, "Error writing %s\n", path.c_str());
+    return false;
+  }
+  files->push_back({section, key_length, name, bytes});
+  fprintf(stderr, "Wrote %s: %" PRId64 " bytes\n", path.c_str(), bytes);
+  return true;
+}
+
+/**
+ * Groups the keys of index by their lengths (in letters).
+ */
+map<int, vector<int>> KeysByLength(LufzUtil* util, const PostingLists& index) {
+  map<int, vector<int>> keys_by_length;
+  for (size_t ki = 0; ki < index.NumKeys(); ++ki) {
+    keys_by_length[util->PartsOf(index.keys[ki], false).size()].push_back(ki);
+  }
+  return keys_by_length;
+}
+
+/**
+ * Writes the output as separately loadable JSON files in dir, so that
+ * clients can load the lexicon first and the rest on demand:
+ *   core.json: {"letters": [...], "lexicon": [...]}
+ *   index-<n>.json: the index entries for keys of length n, as an object.
+ *   indextrie.json: the tries of indexing keys, by length.
+ *   longindex-<n>.json: the longindex keys of length n, as an object.
+ *   suffixindex-<n>.json: the suffixindex keys of length n, as an object.
+ *   anagrams.json: the anagrams shards, as an array.
+ *   agmindex-<n>.json: the agmindex keys of length n, as an object.
+ *   phones.json, phindex.json: arrays.
+ *   phoneindex.json: the phoneindex keys, as an object.
+ * (indextrie, longindex, suffixindex, agmindex and phoneindex only if they
+ * are in extra_sections) and manifest.json, which has the metadata and
+ * lists these files:
+ *   {"id": ..., "language": ..., "script": ..., "postingEncoding": ...,
+ *    "agmindexVersion": ..., (and so on, for each of extra_sections)
+ *    "files": [{"section": "index", "length": 3, "file": "index-3.json",
+ *               "bytes": 12345}, ...]}
+ */
+bool WriteSplitOutput(
+    const string& dir,
+    LufzUtil* util,
+    const Lexicon& lexicon,
+    const PostingLists& index,
+    const map<int, KeyTrie>& key_tries,
+    const PostingLists& long_index,
+    const PostingLists& suffix_index,
+    const vector<vector<int>>& agm_shards,
+    const PostingLists& agm_index,
+    const vector<set<int>>& phone_shards,
+    const PostingLists& phone_index,
+    const set<string>& extra_sections,
+    bool vlq) {
+  if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+    fprintf(stderr, "Could not create directory %s\n", dir.c_str());
+    return false;
+  }
+  vector<SplitFile> files;
+  bool ok = WriteSplitFile(dir, "core", 0, "core.json",
+      [&lexicon](OutputWriter* out) {
+        out->Append("{\n  \"letters\": [");
+        WriteLetters(lexicon, false, out);
+        out->Append("],\n  \"lexicon\": [\n    ");
+        WriteForms(lexicon, false, out);
+        out->Append("\n  ]\n}\n");
+      }, &files);
+  for (const auto& keys : KeysByLength(util, index)) {
+    ok = ok && WriteSplitFile(
+        dir, "index", keys.first,
+        "index-" + to_string(keys.first) + ".json",
+        [&index, &keys, vlq](OutputWriter* out) {
+          out->Append("{\n");
+          WritePostingLists(index, keys.second, "  ", vlq, out);
+          out->Append("}\n");
+        }, &files);
+  }
+  // Writes the keys of each length of an index in extra_sections.
+  auto write_by_length = [&](const string& section,
+                             const PostingLists& section_index) {
+    if (extra_sections.count(section) == 0) {
+      return;
+    }
+    for (const auto& keys : KeysByLength(util, section_index)) {
+      ok = ok && WriteSplitFile(
+          dir, section, keys.first,
+          section + "-" + to_string(keys.first) + ".json",
+          [&section_index, &keys, vlq](OutputWriter* out) {
+            out->Append("{\n");
+            WritePostingLists(section_index, keys.second, "  ", vlq, out);
+            out->Append("}\n");
+          }, &files);
+    }
+  };
+  if (extra_sections.count("indextrie") > 0) {
+    ok = ok && WriteSplitFile(dir, "indextrie", 0, "indextrie.json",
+        [&key_tries](OutputWriter* out) {
+          out->Append("{\n");
+          WriteKeyTries(key_tries, "  ", out);
+          out->Append("}\n");
+        }, &files);
+  }
+  write_by_length("longindex", long_index);
+  write_by_length("suffixindex", suffix_index);
+  ok = ok && WriteSplitFile(dir, "anagrams", 0, "anagrams.json",
+      [&agm_shards, vlq](OutputWriter* out) {
+        out->Append("[\n");
+        WriteShards(agm_shards, vlq, out);
+        out->Append("]\n");
+      }, &files);
+  write_by_length("agmindex", agm_index);
+  ok = ok && WriteSplitFile(dir, "phones", 0, "phones.json",
+      [&lexicon](OutputWriter* out) {
+        out->Append("[\n    ");
+        WritePhones(lexicon, false, out);
+        out->Append("\n]\n");
+      }, &files);
+  ok = ok && WriteSplitFile(dir, "phindex", 0, "phindex.json",
+      [&phone_shards, vlq](OutputWriter* out) {
+        out->Append("[\n");
+        WriteShards(phone_shards, vlq, out);
+        out->Append("]\n");
+      }, &files);
+  if (extra_sections.count("phoneindex") > 0) {
+    ok = ok && WriteSplitFile(dir, "phoneindex", 0, "phoneindex.json",
+        [&phone_index, vlq](OutputWriter* out) {
+          out->Append("{\n");
+          WritePostingLists(phone_index, "  ", vlq, out);
+          out->Append("}\n");
+        }, &files);
+  }
+  if (!ok) {
+    return false;
+  }
+
+  string manifest = "{\n  \"id\": \"Lufz-" + util->Language() + "-" +
+      VERSION + "\",\n  \"language\": \"" + util->Language() +
+      "\",\n  \"script\": \"" + util->Script() +
+      "\",\n  \"postingEncoding\": \"" + (vlq ? "vlq" : "plain") + "\",\n";
+  const map<string, int> versions = {
+      {"agmindex", AGM_EXACT_INDEX_VERSION},
+      {"phoneindex", PHONE_EXACT_INDEX_VERSION},
+      {"indextrie", INDEX_TRIE_VERSION},
+      {"longindex", LONG_INDEX_VERSION},
+      {"suffixindex", SUFFIX_INDEX_VERSION}};
+  for (const string& section : EXTRA_SECTIONS) {
+    if (extra_sections.count(section) > 0) {
+      manifest += "  \"" + section + "Version\": " +
+          to_string(versions.at(section)) + ",\n";
+    }
+  }
+  manifest += "  \"files\": [\n";
+  for (size_t i = 0; i < files.size(); ++i) {
+    const SplitFile& file = files[i];
+    manifest += "    {\"section\": \"" + file.section + "\", ";
+    if (file.key_length > 0) {
+      manifest += "\"length\": " + to_string(file.key_length) + ", ";
+    }
+    manifest += "\"file\": \"" + file.file + "\", \"bytes\": " +
+        to_string(file.bytes) + "}";
+    manifest += (i + 1 < files.size()) ? ",\n" : "\n";
+  }
+  manifest += "  ]\n}\n";
+  vector<SplitFile> manifest_file;
+  if (!WriteSplitFile(dir, "manifest", 0, "manifest.json",
+                      [&manifest](OutputWriter* out) {
+                        out->Append(manifest);
+                      }, &manifest_file)) {
+    return false;
+  }
+  fprintf(stderr, "Manifest:\n%s", manifest.c_str());
+  return true;
 }
 
 /**
@@ -100,30 +1253,29 @@ bool AddPronunciations(
     fprintf(stderr, "Null lexicon passed");
     return false;
   }
-  FILE* fp = fopen(phones_file, "r");
-  if (!fp) {
-    fprintf(stderr, "Could not open %s\n", phones_file);
+  LineReader reader;
+  if (!reader.Open(phones_file)) {
     return false;
   }
   fprintf(stderr, "Adding proninciations from %s\n", phones_file);
 
   unordered_map<string, int> lexicon_index;
-  for (int i = 0; i < lexicon->phrase_infos.size(); i++) {
+  for (size_t i = 0; i < lexicon->phrase_infos.size(); i++) {
     const auto& phrase_info = lexicon->phrase_infos[i];
     lexicon_index[phrase_info.normalized] = i;
   }
 
-  char buf[MAX_LINE_LENGTH];
+  string_view buf;
   int num_pronunciations_used = 0;
   int num_pronunciations_total = 0;
   double total_phone_len = 0;
   int max_phone_len = 0;
-  while (fgets(buf, sizeof(buf), fp)) {
+  while (reader.Next(&buf)) {
     ++num_pronunciations_total;
     string line(buf);
     vector<string> line_parts = util->Split(line, "\t");
     if (line_parts.size() != 2) {
-      fprintf(stderr, "Expect exactly one tab - ignoring line: %s\n", buf);
+      fprintf(stderr, "Expect exactly one tab - ignoring line: %s\n", line.c_str());
       continue;
     }
     string normalized = util->StrLetterizedPrunedPartsOf(line_parts[0]);
@@ -136,7 +1288,7 @@ bool AddPronunciations(
     }
     vector<string> phone_parts = phone_util->LettersOf(line_parts[1]);
     if (phone_parts.empty()) {
-      fprintf(stderr, "Empty pronunciation in: %s\n", buf);
+      fprintf(stderr, "Empty pronunciation in: %s\n", line.c_str());
       continue;
     }
     string phone = phone_util->Join(phone_parts);
@@ -149,12 +1301,14 @@ bool AddPronunciations(
     }
     ++num_pronunciations_used;
     total_phone_len += phone_parts.size();
-    if (phone_parts.size() > max_phone_len) {
+    if (int(phone_parts.size()) > max_phone_len) {
       max_phone_len = phone_parts.size();
     }
     phrase_info.phones.insert(phone_parts);
   }
-  fclose(fp);
+  if (reader.Failed()) {
+    return false;
+  }
 
   fprintf(stderr, "Read pronunciations file, used %d out of %d\n",
           num_pronunciations_used, num_pronunciations_total);
@@ -168,89 +1322,269 @@ bool AddPronunciations(
 int main(int argc, char* argv[]) {
   using namespace lufz;
 
-  if (argc != 5) {
-    fprintf(stderr, "Usage: %s <Language> <lexicon_file> <cmu-pronunciations-file> <crossed-words>\n",
+  vector<string> args;
+  map<string, string> flags;
+  if (!ParseArgs(argc, argv, {"threads", "index_builder", "sort_buffer_mb",
+                                 "bundle", "posting_encoding",
+                                 "gzip_output", "split_output",
+                                 "extra_sections"},
+                 &args, &flags) || args.size() != 4) {
+    fprintf(stderr, "Usage: %s <Language> <lexicon_file> <cmu-pronunciations-file> <crossed-words> [--threads=<n>] [--index_builder=count|sort] [--sort_buffer_mb=<n>] [--bundle=<file>] [--posting_encoding=plain|vlq] [--gzip_output=<file> | --split_output=<dir>] [--extra_sections=<section>,...|all]\n",
             argv[0]);
+    fprintf(stderr, "  The index is built using --threads threads (default: "
+                    "all cores). The\n  output does not depend on the "
+                    "number of threads.\n");
+    fprintf(stderr, "  --index_builder=count (the default) counts wildcard "
+                    "keys in one pass\n  and builds the index in another. "
+                    "--index_builder=sort generates\n  (key, phrase) pairs "
+                    "once and sorts them, using --sort_buffer_mb\n  "
+                    "(default: 1024) of memory for pairs, beyond which "
+                    "sorted runs are\n  spilled to temporary files. Both "
+                    "give the same output.\n");
+    fprintf(stderr, "  --bundle=<file> also writes the lexicon as a binary "
+                    "bundle of typed\n  arrays (see "
+                    "lufz-lexicon-bundle.js).\n");
+    fprintf(stderr, "  --posting_encoding=vlq writes lists of lexicon "
+                    "indices as strings of\n  base64 variable-length "
+                    "deltas, decoded by JavaScript in the output.\n");
+    fprintf(stderr, "  --gzip_output=<file> also writes the output, "
+                    "gzipped (in parallel), to\n  <file>.\n");
+    fprintf(stderr, "  --split_output=<dir> writes the output as separate "
+                    "JSON files (the\n  lexicon, index and anagram "
+                    "chunks by key length, phones) with a\n  "
+                    "manifest.json, in <dir>, instead of to stdout.\n");
+    fprintf(stderr, "  --extra_sections also writes these sections (in all "
+                    "the outputs):\n  indextrie, longindex, suffixindex, "
+                    "agmindex, phoneindex (or all of\n  them, with "
+                    "--extra_sections=all). By default, none are written.\n");
+    return 2;
+  }
+  int num_threads = flags.count("threads") > 0 ?
+      atoi(flags["threads"].c_str()) : thread::hardware_concurrency();
+  if (num_threads < 1) {
+    num_threads = 1;
+  }
+  const string posting_encoding = flags.count("posting_encoding") > 0 ?
+      flags["posting_encoding"] : "plain";
+  if (posting_encoding != "plain" && posting_encoding != "vlq") {
+    fprintf(stderr, "Unknown --posting_encoding: %s\n",
+            posting_encoding.c_str());
+    return 2;
+  }
+  const bool vlq = posting_encoding == "vlq";
+  if (flags.count("split_output") > 0 && flags.count("gzip_output") > 0) {
+    fprintf(stderr, "Cannot use both --split_output and --gzip_output\n");
     return 2;
   }
 
-  LufzUtil util(argv[1]);
+  LufzUtil util(args[0]);
   LufzUtil phone_util("Phonetics");
 
+  set<string> extra_sections;
+  if (flags.count("extra_sections") > 0) {
+    for (const string& section : util.Split(flags["extra_sections"], ",")) {
+      if (section == "all") {
+        extra_sections.insert(EXTRA_SECTIONS.begin(), EXTRA_SECTIONS.end());
+      } else if (find(EXTRA_SECTIONS.begin(), EXTRA_SECTIONS.end(),
+                      section) != EXTRA_SECTIONS.end()) {
+        extra_sections.insert(section);
+      } else {
+        fprintf(stderr, "Unknown section in --extra_sections: %s\n",
+                section.c_str());
+        return 2;
+      }
+    }
+  }
+  auto want = [&extra_sections](const string& section) {
+    return extra_sections.count(section) > 0;
+  };
+
   Lexicon lexicon;
 
-  if (!util.ReadLexicon(argv[2], &lexicon, argv[4])) {
+  if (!util.ReadLexicon(args[1].c_str(), &lexicon, args[3].c_str())) {
     return 2;
   }
-  fprintf(stderr, "Read lexicon, have %d entries\n", lexicon.phrase_infos.size());
+  fprintf(stderr, "Read lexicon, have %zu entries\n",
+          lexicon.phrase_infos.size());
 
-  if (!AddPronunciations(&util, &phone_util, argv[3], &lexicon)) {
+  if (!AddPronunciations(&util, &phone_util, args[2].c_str(), &lexicon)) {
     return 2;
   }
+  const int num_phrases = lexicon.phrase_infos.size();
 
   /**
-   * First, do a pass to decide which indexing keys to keep. This is
-   * much faster than building the full index and then pruning
-   * away keys that do not have many entries.
+   * Encode the key of each phrase as a WildKey, so that the wildcard
+   * variants of keys can be enumerated without building strings.
    */
-  map<string, int> indexing_key_counts;
-  fprintf(stderr, "Computing indexing_key_counts...\n");
-  for (int i = 0; i < lexicon.phrase_infos.size(); ++i) {
-    const PhraseInfo& phrase_info = lexicon.phrase_infos[i];
-    const string& normalized = phrase_info.normalized;
-    if (normalized.empty()) continue;
-    int count = phrase_info.forms.size();
-    AddKeyCounts(normalized, count, &util, &indexing_key_counts);
-    if (i > 0 && i % 1000 == 0) {
-      fprintf(stderr, "Indexing key counts at %d: %s\n", i, normalized.c_str());
-    }
-  }
-  fprintf(stderr, "Pre-filtering, index has size: %d\n", indexing_key_counts.size());
-  std::set<std::string> indexing_keys;
-  // Filter
-  const int MIN_COUNT = 1024;
-  int ki = 0;
-  for (const auto& [key, count] : indexing_key_counts) {
-    if (ki % 10000 == 0) {
-      fprintf(stderr, "Indexing key count #%d for [%s] = %d\n", ki, key.c_str(), count);
-    }
-    ki++;
-    if (count < MIN_COUNT && !util.AllWild(key)) {
-      continue;
+  WildKeyEncoder key_encoder;
+  vector<WildKey> keys(num_phrases);
+  // Also find the anagram shard and the pronunciation shards of each phrase.
+  vector<vector<string>> key_parts(num_phrases);
+  vector<int> agm_shard_of(num_phrases, -1);
+  vector<string> agm_keys(num_phrases);
+  // And the letters of the long phrases (see BuildLongIndex()), and their
+  // suffix keys: keys over their reversed letters.
+  vector<vector<string>> long_letters(num_phrases);
+  vector<vector<string>> suffix_key_parts(num_phrases);
+  vector<WildKey> suffix_keys(num_phrases, WildKey{0, 0});
+  vector<vector<int>> phone_shards_of(num_phrases);
+  RunOnThreads(num_threads, [&](int t) {
+    for (int i = int64_t(num_phrases) * t / num_threads;
+         i < int64_t(num_phrases) * (t + 1) / num_threads; ++i) {
+      const PhraseInfo& phrase_info = lexicon.phrase_infos[i];
+      const string& normalized = phrase_info.normalized;
+      for (const vector<string>& phone : phrase_info.phones) {
+        string phone_str = phone_util.Join(phone);
+        phone_shards_of[i].push_back(
+            phone_util.IndexShard(phone_str, PHONE_INDEX_SHARDS));
+      }
+      if (normalized.empty()) continue;
+      key_parts[i] = util.PartsOf(util.Key(normalized), false);
+      agm_keys[i] = util.AgmKey(normalized);
+      if (want("longindex") || want("suffixindex")) {
+        vector<string> letters = util.LettersOf(normalized);
+        if (letters.size() > WILDIZE_ALL_BEYOND) {
+          suffix_key_parts[i].assign(letters.rbegin(), letters.rend());
+          long_letters[i] = std::move(letters);
+        }
+      }
+      agm_shard_of[i] = util.IndexShard(agm_keys[i], AGM_INDEX_SHARDS);
+    }
+  });
+  for (int i = 0; i < num_phrases; ++i) {
+    if (lexicon.phrase_infos[i].normalized.empty()) continue;
+    if (!key_encoder.Encode(key_parts[i], &keys[i])) {
+      return 2;
+    }
+  }
+  key_parts.clear();
+  for (int i = 0; i < num_phrases; ++i) {
+    if (suffix_key_parts[i].empty()) continue;
+    if (!key_encoder.Encode(suffix_key_parts[i], &suffix_keys[i])) {
+      return 2;
+    }
+  }
+  suffix_key_parts.clear();
+
+  const string index_builder = flags.count("index_builder") > 0 ?
+      flags["index_builder"] : "count";
+  if (index_builder != "count" && index_builder != "sort") {
+    fprintf(stderr, "Unknown --index_builder: %s\n", index_builder.c_str());
+    return 2;
+  }
+  const int64_t sort_buffer_mb = flags.count("sort_buffer_mb") > 0 ?
+      atoll(flags["sort_buffer_mb"].c_str()) : 1024;
+  auto build_index = [&](const vector<WildKey>& keys, int min_length,
+                         PostingLists* index) {
+    if (index_builder == "count") {
+      return BuildIndexByCounting(lexicon, keys, key_encoder, min_length,
+                                  num_threads, index);
+    }
+    return BuildIndexBySorting(lexicon, keys, key_encoder, min_length,
+                               (sort_buffer_mb << 20) / sizeof(KeyPhrase),
+                               num_threads, index);
+  };
+  PostingLists index;
+  if (!build_index(keys, 0, &index)) {
+    return 2;
+  }
+
+  map<int, KeyTrie> key_tries;
+  if (want("indextrie")) {
+    key_tries = BuildKeyTries(&util, index);
+    int num_trie_nodes = 0;
+    for (const auto& trie : key_tries) {
+      num_trie_nodes += trie.second.NumNodes();
     }
-    indexing_keys.insert(key);
+    fprintf(stderr, "Built key tries with %d nodes\n", num_trie_nodes);
   }
-  fprintf(stderr, "Post-filtering, index has size: %d\n", indexing_keys.size());
 
-  fprintf(stderr, "Building index and agm-index...\n");
-  map<string, set<int>> index;
+  fprintf(stderr, "Building agm-index...\n");
   vector<vector<int>> agm_shards(AGM_INDEX_SHARDS);
-  for (int i = 0; i < lexicon.phrase_infos.size(); ++i) {
-    const PhraseInfo& phrase_info = lexicon.phrase_infos[i];
-    const string& normalized = phrase_info.normalized;
-    if (normalized.empty()) continue;
-    vector<int> lex_indices;
-    for (int j = 0; j < phrase_info.forms.size(); ++j) {
-      lex_indices.push_back(phrase_info.base_index + j);
+  CollectShardForms(
+      lexicon,
+      [&agm_shard_of](int i, auto add) {
+        if (agm_shard_of[i] >= 0) add(agm_shard_of[i]);
+      },
+      num_threads, &agm_shards);
+
+  PostingLists agm_index;
+  if (want("agmindex")) {
+    fprintf(stderr, "Building exact agm-index...\n");
+    vector<pair<string, int>> key_phrases;
+    for (int i = 0; i < num_phrases; ++i) {
+      if (agm_shard_of[i] < 0) continue;
+      key_phrases.emplace_back(std::move(agm_keys[i]), i);
     }
-    AddKeys(normalized, indexing_keys, lex_indices, &util, &index);
-    AddAgmKey(normalized, lex_indices, &util, &agm_shards);
-    if (i > 0 && i % 1000 == 0) {
-      fprintf(stderr, "Indexed at %d: %s\n", i, normalized.c_str());
+    agm_keys.clear();
+    BuildExactIndex(lexicon, &key_phrases, &agm_index);
+  }
+
+  PostingLists long_index;
+  if (want("longindex")) {
+    fprintf(stderr, "Building long-index...\n");
+    BuildLongIndex(lexicon, &long_letters, &long_index);
+  }
+  long_letters.clear();
+
+  /**
+   * The keys of the main index only have letters at the start, so for
+   * long phrases, the suffix index is built the same way (with the same
+   * pruning) from keys over their reversed letters.
+   */
+  PostingLists suffix_index;
+  if (want("suffixindex")) {
+    fprintf(stderr, "Building suffix-index...\n");
+    PostingLists reversed_index;
+    if (!build_index(suffix_keys, WILDIZE_ALL_BEYOND + 1, &reversed_index)) {
+      return 2;
     }
+    ReportSuffixBuckets(lexicon, suffix_keys, key_encoder, reversed_index);
+    ReverseSuffixKeys(&util, reversed_index, &suffix_index);
   }
+  suffix_keys.clear();
 
   fprintf(stderr, "Building phones-index...\n");
   vector<set<int>> phone_shards(PHONE_INDEX_SHARDS);
-  for (int i = 0; i < lexicon.phrase_infos.size(); ++i) {
-    const PhraseInfo& phrase_info = lexicon.phrase_infos[i];
-    for (const vector<string>& phone : phrase_info.phones) {
-      string phone_str = phone_util.Join(phone);
-      int shard = phone_util.IndexShard(phone_str, PHONE_INDEX_SHARDS);
-      for (int j = 0; j < phrase_info.forms.size(); ++j) {
-        phone_shards[shard].insert(phrase_info.base_index + j);
+  {
+    // A phrase can have several pronunciations in the same shard, so the
+    // forms get deduplicated into sets.
+    vector<vector<int>> phone_shard_forms(PHONE_INDEX_SHARDS);
+    CollectShardForms(
+        lexicon,
+        [&phone_shards_of](int i, auto add) {
+          for (int shard : phone_shards_of[i]) add(shard);
+        },
+        num_threads, &phone_shard_forms);
+    RunOnThreads(num_threads, [&](int t) {
+      for (int s = t; s < PHONE_INDEX_SHARDS; s += num_threads) {
+        phone_shards[s].insert(phone_shard_forms[s].begin(),
+                               phone_shard_forms[s].end());
       }
+    });
+  }
+
+  PostingLists phone_index;
+  const PhonemeIds phoneme_ids(lexicon);
+  if (phoneme_ids.NumPhonemes() > 0xffff) {
+    fprintf(stderr, "Too many distinct phonemes: %d\n",
+            phoneme_ids.NumPhonemes());
+    return 2;
+  }
+  if (want("phoneindex")) {
+    fprintf(stderr, "Building exact phones-index...\n");
+    vector<pair<string, int>> key_phrases;
+    for (int i = 0; i < num_phrases; ++i) {
+      for (const vector<string>& phone : lexicon.phrase_infos[i].phones) {
+        key_phrases.emplace_back(phoneme_ids.Pack(phone), i);
+      }
+    }
+    BuildExactIndex(lexicon, &key_phrases, &phone_index);
+    for (string& key : phone_index.keys) {
+      key = phoneme_ids.Unpack(key);
     }
+    fprintf(stderr, "Total# exact phone keys: %zu, #phonemes: %d\n",
+            phone_index.NumKeys(), phoneme_ids.NumPhonemes());
   }
 
   struct KeyInfoByLen {
@@ -266,13 +1600,13 @@ int main(int argc, char* argv[]) {
   };
 
   map<int, KeyInfoByLen> len_counts;
-  for (const auto& kv : index) {
-    int vsize = kv.second.size();
-    const vector<string> parts = util.PartsOf(kv.first, false);
+  for (size_t ki = 0; ki < index.NumKeys(); ++ki) {
+    int vsize = index.Size(ki);
+    const vector<string> parts = util.PartsOf(index.keys[ki], false);
     KeyInfoByLen counts = len_counts[parts.size()];
     counts.num_keys++;
     counts.total_phrases += vsize;
-    if (util.AllWild(kv.first)) {
+    if (util.AllWild(index.keys[ki])) {
       counts.num_distinct_phrases = vsize;
     } else if (vsize > counts.max_phrases_for_a_key) {
       counts.max_phrases_for_a_key = vsize;
@@ -290,7 +1624,8 @@ int main(int argc, char* argv[]) {
     total_vals += lc.second.total_phrases;
     total_distinct_phrases += lc.second.num_distinct_phrases;
   }
-  fprintf(stderr, "Total #keys: %lld #phrases: %lld #distinct-phrases: %lld\n",
+  fprintf(stderr, "Total #keys: %" PRId64 " #phrases: %" PRId64
+                  " #distinct-phrases: %" PRId64 "\n",
           total_keys, total_vals, total_distinct_phrases);
 
   map<int, int> agm_counts;
@@ -308,8 +1643,23 @@ int main(int argc, char* argv[]) {
   for (const auto& lc : agm_counts) {
     fprintf(stderr, "agmvalslen:%5d #keys: %3d\n", lc.first, lc.second);
   }
-  fprintf(stderr, "Total# agm keys: %d\n", agm_shards.size());
+  fprintf(stderr, "Total# agm keys: %zu\n", agm_shards.size());
   fprintf(stderr, "Bulkiest key: %d [%d]\n", biggest_key, biggest_count);
+  int biggest_exact_key = -1;
+  for (size_t ki = 0; ki < agm_index.NumKeys(); ++ki) {
+    if (biggest_exact_key < 0 ||
+        agm_index.Size(ki) > agm_index.Size(biggest_exact_key)) {
+      biggest_exact_key = ki;
+    }
+  }
+  if (want("agmindex")) {
+    fprintf(stderr, "Total# exact agm keys: %zu\n", agm_index.NumKeys());
+  }
+  if (biggest_exact_key >= 0) {
+    fprintf(stderr, "Bulkiest exact agm key: %s [%" PRId64 "]\n",
+            agm_index.keys[biggest_exact_key].c_str(),
+            agm_index.Size(biggest_exact_key));
+  }
 
   // Output the JS for creating the exetLexicon object. We use JSON parsing
   // as directly initializing such a large object with so many long arrays
@@ -326,141 +1676,258 @@ int main(int argc, char* argv[]) {
   //     "A??": [234,678,...],
   //     ...
   //   },
+  //   "indextrie": {
+  //     "version": 1,
+  //     "lengths": {
+  //       "3": {"?":{},"A":{"?":{},...},...},
+  //       ...
+  //     }
+  //   },
+  //   "longindex": {
+  //     "version": 1,
+  //     "keys": {
+  //       "???A???????????": [5120,...],
+  //       ...
+  //     }
+  //   },
+  //   "suffixindex": {
+  //     "version": 1,
+  //     "keys": {
+  //       "?????????NESS": [7310,...],
+  //       ...
+  //     }
+  //   },
   //   "anagrams": [
   //     [43,1,...],
   //     [43,1,...],
   //     ...
   //   ],
+  //   "agmindex": {
+  //     "version": 1,
+  //     "keys": {
+  //       "AAABNN": [4120,...],
+  //       ...
+  //     }
+  //   },
   //   "phones": [[],[],...,[["B","AH","N","AE","N","AH"]], ...],
   //   "phindex": [
   //     [42,...],
   //     [142,3232, ...],
   //     ...
-  //   ]
+  //   ],
+  //   "phoneindex": {
+  //     "version": 1,
+  //     "keys": {
+  //       "B AH N AE N AH": [3120,...],
+  //       ...
+  //     }
+  //   }
   // }`);
-  printf("exetLexicon = JSON.parse(`{");
-  printf("\n  \"id\": \"Lufz-%s-%s\",",
-         util.Language().c_str(), VERSION.c_str());
-  printf("\n  \"language\": \"%s\",", util.Language().c_str());
-  printf("\n  \"script\": \"%s\",", util.Script().c_str());
-  printf("\n  \"letters\": [");
-  int letters_i = 0;
-  for (const string& letter : lexicon.letters) {
-    if (letters_i > 0) printf(", ");
-    ++letters_i;
-    printf("\"%s\"", letter.c_str());
+  // indextrie, longindex, suffixindex, agmindex and phoneindex are only
+  // written if asked for with --extra_sections.
+  // With --posting_encoding=vlq, each list of lexicon indices (such as
+  // [42,390,2234,...]) is instead a string (see WriteIds()), and the
+  // output ends with JavaScript (VLQ_DECODER) that decodes them in place.
+  /**
+   * The sections are serialized separately: with more than one thread,
+   * in parallel, into memory, while the ones that are done are written out
+   * in order.
+   */
+  vector<function<void(OutputWriter*)>> sections;
+  sections.push_back([&](OutputWriter* out) {
+    out->Append("exetLexicon = JSON.parse(`{");
+    out->Append("\n  \"id\": \"Lufz-");
+    out->Append(util.Language());
+    out->Append('-');
+    out->Append(VERSION);
+    out->Append("\",\n  \"language\": \"");
+    out->Append(util.Language());
+    out->Append("\",\n  \"script\": \"");
+    out->Append(util.Script());
+    out->Append("\",\n  \"letters\": [");
+    WriteLetters(lexicon, true, out);
+    out->Append("],");
+    out->Append("\n  \"lexicon\": [\n    ");
+    WriteForms(lexicon, true, out);
+    out->Append("\n  ],");
+  });
+  sections.push_back([&](OutputWriter* out) {
+    out->Append("\n  \"index\": {\n");
+    WritePostingLists(index, "    ", vlq, out);
+    out->Append("  },");
+  });
+  if (want("indextrie")) {
+    sections.push_back([&](OutputWriter* out) {
+      out->Append("\n  \"indextrie\": {");
+      out->Append("\n    \"version\": ");
+      out->AppendInt(INDEX_TRIE_VERSION);
+      out->Append(",\n    \"lengths\": {\n");
+      WriteKeyTries(key_tries, "      ", out);
+      out->Append("    }");
+      out->Append("\n  },");
+    });
   }
-  printf("],");
-  printf("\n  \"lexicon\": [\n    ");
-  int lnum = 0;
-  for (int i = 0; i < lexicon.phrase_infos.size(); ++i) {
-    const PhraseInfo& phrase_info = lexicon.phrase_infos[i];
-    for (const string& form : phrase_info.forms) {
-      if (lnum > 0) {
-        printf(",");
-        if (lnum % 100 == 0) printf("\n    ");
-      }
-      printf("\"%s\"", form.c_str());
-      lnum++;
+  if (want("longindex")) {
+    sections.push_back([&](OutputWriter* out) {
+      out->Append("\n  \"longindex\": {");
+      out->Append("\n    \"version\": ");
+      out->AppendInt(LONG_INDEX_VERSION);
+      out->Append(",\n    \"keys\": {\n");
+      WritePostingLists(long_index, "      ", vlq, out);
+      out->Append("    }");
+      out->Append("\n  },");
+    });
+  }
+  if (want("suffixindex")) {
+    sections.push_back([&](OutputWriter* out) {
+      out->Append("\n  \"suffixindex\": {");
+      out->Append("\n    \"version\": ");
+      out->AppendInt(SUFFIX_INDEX_VERSION);
+      out->Append(",\n    \"keys\": {\n");
+      WritePostingLists(suffix_index, "      ", vlq, out);
+      out->Append("    }");
+      out->Append("\n  },");
+    });
+  }
+  sections.push_back([&](OutputWriter* out) {
+    out->Append("\n  \"anagrams\": [\n");
+    WriteShards(agm_shards, vlq, out);
+    out->Append("  ],");
+  });
+  if (want("agmindex")) {
+    sections.push_back([&](OutputWriter* out) {
+      out->Append("\n  \"agmindex\": {");
+      out->Append("\n    \"version\": ");
+      out->AppendInt(AGM_EXACT_INDEX_VERSION);
+      out->Append(",\n    \"keys\": {\n");
+      WritePostingLists(agm_index, "      ", vlq, out);
+      out->Append("    }");
+      out->Append("\n  },");
+    });
+  }
+  sections.push_back([&](OutputWriter* out) {
+    out->Append("\n  \"phones\": [\n    ");
+    WritePhones(lexicon, true, out);
+    out->Append("\n  ],");
+  });
+  sections.push_back([&](OutputWriter* out) {
+    out->Append("\n  \"phindex\": [\n");
+    WriteShards(phone_shards, vlq, out);
+    out->Append("  ]");
+  });
+  // The last section, so it starts with the comma after the previous one.
+  if (want("phoneindex")) {
+    sections.push_back([&](OutputWriter* out) {
+      out->Append(",\n  \"phoneindex\": {");
+      out->Append("\n    \"version\": ");
+      out->AppendInt(PHONE_EXACT_INDEX_VERSION);
+      out->Append(",\n    \"keys\": {\n");
+      WritePostingLists(phone_index, "      ", vlq, out);
+      out->Append("    }");
+      out->Append("\n  }");
+    });
+  }
+  sections.push_back([&](OutputWriter* out) {
+    out->Append("\n}`);\n");
+    if (vlq) {
+      out->Append(VLQ_DECODER + 1);
+    }
+    if (util.Language() == "en") {
+      out->Append("/**\n");
+      out->Append(" * --- Paste contents of lufz-en-lexicon-stems-patch.js above, ---\n");
+      out->Append(" * ---   just above the line with the closing brace.           ---\n");
+      out->Append(" * --- Generate it using lufz-en-lexicon-get-stems-patch.html. ---\n");
+      out->Append(" * --- Delete these comment lines when done.                   ---\n");
+      out->Append(" */\n");
     }
+  });
+
+  if (flags.count("bundle") > 0 &&
+      !WriteBundle(flags["bundle"], &util, lexicon, index, long_index,
+                   suffix_index, agm_shards, agm_index, phoneme_ids,
+                   phone_shards, phone_index, extra_sections)) {
+    return 2;
   }
-  printf("\n  ],");
-  printf("\n  \"index\": {\n");
-  int index_i = 0;
-  for (const auto& kv : index) {
-    printf("    \"%s\": [\n      ", kv.first.c_str());
-    int counter = 0;
-    for (int lex_index : kv.second) {
-      if (counter > 0) {
-        printf(",");
-        if (counter % 100 == 0) printf("\n      ");
-      }
-      counter++;
-      printf("%d", lex_index);
-    }
-    printf("\n    ]");
-    ++index_i;
-    if (index_i < index.size()) {
-      printf(",");
-    }
-    printf("\n");
-  }
-  printf("  },");
-  printf("\n  \"anagrams\": [\n");
-  int shard_i = 0;
-  for (const auto& shard : agm_shards) {
-    printf("    [\n      ");
-    for (int i = 0; i < shard.size(); ++i) {
-      if (i > 0) {
-        printf(",");
-        if (i % 100 == 0) printf("\n      ");
-      }
-      printf("%d", shard[i]);
+
+  if (flags.count("split_output") > 0) {
+    fprintf(stderr, "Writing split output...\n");
+    if (!WriteSplitOutput(flags["split_output"], &util, lexicon, index,
+                          key_tries, long_index, suffix_index, agm_shards,
+                          agm_index, phone_shards, phone_index,
+                          extra_sections, vlq)) {
+      return 2;
     }
-    shard_i++;
-    printf("\n    ]");
-    if (shard_i < agm_shards.size()) {
-      printf(",");
+    return 0;
+  }
+
+  fprintf(stderr, "Writing output...\n");
+  const auto write_start = chrono::steady_clock::now();
+  OutputWriter out(stdout);
+  GzipWriter gzip(num_threads, Z_DEFAULT_COMPRESSION);
+  if (flags.count("gzip_output") > 0) {
+    if (!gzip.Open(flags["gzip_output"])) {
+      return 2;
     }
-    printf("\n");
+    out.SetGzip(&gzip);
   }
-  printf("  ],");
-  printf("\n  \"phones\": [\n    ");
-  lnum = 0;
-  for (int i = 0; i < lexicon.phrase_infos.size(); ++i) {
-    const PhraseInfo& phrase_info = lexicon.phrase_infos[i];
-    for (const string& form : phrase_info.forms) {
-      if (lnum > 0) {
-        printf(",");
-        if (lnum % 100 == 0) printf("\n    ");
-      }
-      lnum++;
-      printf("[");
-      int j = 0;
-      for (const vector<string>& phone : phrase_info.phones) {
-        if (j > 0) printf(",");
-        j++;
-        printf("[");
-        for (int k = 0; k < phone.size(); k++) {
-          if (k > 0) printf(",");
-          printf("\"%s\"", phone[k].c_str());
+  if (num_threads > 1) {
+    // Sections are picked up in order by whichever thread is free. The main
+    // thread (t == 0) writes out each section as soon as it and those
+    // before it are done (and frees it), and serializes sections itself
+    // while it waits.
+    vector<unique_ptr<OutputWriter>> section_outs(sections.size());
+    vector<bool> section_done(sections.size(), false);
+    size_t next_section = 0;
+    mutex section_mutex;
+    condition_variable section_cv;
+    RunOnThreads(num_threads, [&](int t) {
+      size_t next_write = 0;
+      unique_lock<mutex> lock(section_mutex);
+      while (t == 0 ? next_write < sections.size()
+                    : next_section < sections.size()) {
+        if (t == 0 && section_done[next_write]) {
+          unique_ptr<OutputWriter> section_out =
+              std::move(section_outs[next_write++]);
+          lock.unlock();
+          out.Append(section_out->Contents());
+          section_out.reset();
+          lock.lock();
+        } else if (next_section < sections.size()) {
+          const size_t s = next_section++;
+          lock.unlock();
+          unique_ptr<OutputWriter> section_out(new OutputWriter);
+          sections[s](section_out.get());
+          lock.lock();
+          section_outs[s] = std::move(section_out);
+          section_done[s] = true;
+          section_cv.notify_all();
+        } else {
+          section_cv.wait(lock);
         }
-        printf("]");
       }
-      printf("]");
+    });
+  } else {
+    for (const auto& section : sections) {
+      section(&out);
     }
   }
-  printf("\n  ],");
-  printf("\n  \"phindex\": [\n");
-  shard_i = 0;
-  for (const auto& shard : phone_shards) {
-    printf("    [\n      ");
-    int i = 0;
-    for (int idx : shard) {
-      if (i > 0) {
-        printf(",");
-        if (i % 100 == 0) printf("\n      ");
-      }
-      i++;
-      printf("%d", idx);
-    }
-    printf("\n    ]");
-    ++shard_i;
-    if (shard_i < phone_shards.size()) {
-      printf(",");
-    }
-    printf("\n");
-  }
-  printf("  ]\n");
-  printf("}`);\n");
-  if (util.Language() == "en") {
-    printf("/**\n");
-    printf(" * --- Paste contents of lufz-en-lexicon-stems-patch.js above, ---\n");
-    printf(" * ---   just above the line with the closing brace.           ---\n");
-    printf(" * --- Generate it using lufz-en-lexicon-get-stems-patch.html. ---\n");
-    printf(" * --- Delete these comment lines when done.                   ---\n");
-    printf(" */\n");
+  if (!out.Flush() || fflush(stdout) != 0) {
+    fprintf(stderr, "Error writing output\n");
+    return 2;
+  }
+  if (flags.count("gzip_output") > 0) {
+    if (!gzip.Close()) {
+      return 2;
+    }
+    fprintf(stderr, "Wrote %s: %" PRId64 " bytes (%.1f%%)\n",
+            flags["gzip_output"].c_str(), gzip.NumBytesOut(),
+            100.0 * gzip.NumBytesOut() / max(gzip.NumBytesIn(), int64_t(1)));
   }
+  const double write_secs = chrono::duration<double>(
+      chrono::steady_clock::now() - write_start).count();
+  fprintf(stderr, "Wrote %" PRId64 " bytes in %.2fs (%.1f MB/s)\n",
+          out.NumBytes(), write_secs,
+          out.NumBytes() / 1e6 / max(write_secs, 1e-6));
 
   return 0;
 }
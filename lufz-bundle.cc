@@ -0,0 +1,164 @@
+#include <stdint.h>
+#include <stdio.h>
+
+#include <string>
+#include <vector>
+
+#include "lufz-bundle.h"
+
+namespace lufz {
+
+namespace {
+const char MAGIC[] = "LUFZBNDL";
+const int ALIGNMENT = 8;
+
+std::string JsonString(const std::string& s) {
+  std::string quoted = "\"";
+  for (char c : s) {
+    if (c == '"' || c == '\\') {
+      quoted += '\\';
+      quoted += c;
+    } else if ((unsigned char)c < 0x20) {
+      char hex[8];
+      snprintf(hex, sizeof(hex), "\\u%04x", (unsigned char)c);
+      quoted += hex;
+    } else {
+      quoted += c;
+    }
+  }
+  return quoted + "\"";
+}
+
+void AppendUint32(uint32_t value, std::string* bytes) {
+  for (int i = 0; i < 4; ++i) {
+    *bytes += char((value >> (8 * i)) & 0xff);
+  }
+}
+
+int64_t Padding(int64_t size) {
+  return (ALIGNMENT - size % ALIGNMENT) % ALIGNMENT;
+}
+
+bool IsLittleEndian() {
+  const uint32_t one = 1;
+  return *reinterpret_cast<const uint8_t*>(&one) == 1;
+}
+}  // namespace
+
+BundleWriter::BundleWriter() : num_array_bytes_(0) {}
+
+void BundleWriter::SetString(const std::string& name,
+                             const std::string& value) {
+  metadata_ += JsonString(name) + ": " + JsonString(value) + ", ";
+}
+
+void BundleWriter::SetStrings(const std::string& name,
+                              const std::vector<std::string>& values) {
+  metadata_ += JsonString(name) + ": [";
+  for (size_t i = 0; i < values.size(); ++i) {
+    if (i > 0) metadata_ += ", ";
+    metadata_ += JsonString(values[i]);
+  }
+  metadata_ += "], ";
+}
+
+void BundleWriter::AddArray(const std::string& name, const std::string& type,
+                            const void* data, int64_t length,
+                            int element_size) {
+  arrays_.push_back({name, type, length,
+                     std::string(static_cast<const char*>(data),
+                                 length * element_size)});
+  num_array_bytes_ += arrays_.back().bytes.size();
+}
+
+void BundleWriter::AddUint8(const std::string& name,
+                            const std::vector<uint8_t>& values) {
+  AddArray(name, "Uint8", values.data(), values.size(), 1);
+}
+
+void BundleWriter::AddUint16(const std::string& name,
+                             const std::vector<uint16_t>& values) {
+  AddArray(name, "Uint16", values.data(), values.size(), 2);
+}
+
+void BundleWriter::AddInt32(const std::string& name,
+                            const std::vector<int32_t>& values) {
+  AddArray(name, "Int32", values.data(), values.size(), 4);
+}
+
+void BundleWriter::AddUint32(const std::string& name,
+                             const std::vector<uint32_t>& values) {
+  AddArray(name, "Uint32", values.data(), values.size(), 4);
+}
+
+void BundleWriter::AddStrings(const std::string& name,
+                              const std::vector<std::string>& strings) {
+  std::vector<uint8_t> bytes;
+  std::vector<uint32_t> offsets(1, 0);
+  for (const std::string& s : strings) {
+    bytes.insert(bytes.end(), s.begin(), s.end());
+    offsets.push_back(bytes.size());
+  }
+  AddUint8(name + ".bytes", bytes);
+  AddUint32(name + ".offsets", offsets);
+}
+
+bool BundleWriter::Write(const std::string& file) const {
+  if (!IsLittleEndian()) {
+    fprintf(stderr, "Bundles can only be written on little-endian hosts\n");
+    return false;
+  }
+  // The array offsets depend on the length of the header, which depends on
+  // the offsets, so start with a guess and grow it until the header fits.
+  int64_t header_room = 1024 + 128 * arrays_.size() + metadata_.size();
+  header_room += Padding(header_room);
+  std::string header;
+  while (true) {
+    const int64_t data_start = 16 + header_room;
+    header = "{" + metadata_ + "\"arrays\": {";
+    int64_t offset = data_start;
+    for (size_t i = 0; i < arrays_.size(); ++i) {
+      const Array& array = arrays_[i];
+      if (i > 0) header += ", ";
+      header += JsonString(array.name) + ": {\"type\": " +
+                JsonString(array.type) + ", \"offset\": " +
+                std::to_string(offset) + ", \"length\": " +
+                std::to_string(array.length) + "}";
+      offset += array.bytes.size() + Padding(array.bytes.size());
+    }
+    header += "}}";
+    if (int64_t(header.size()) <= header_room) {
+      header.append(header_room - header.size(), ' ');
+      break;
+    }
+    header_room = header.size() + Padding(header.size());
+  }
+
+  FILE* fp = fopen(file.c_str(), "wb");
+  if (!fp) {
+    fprintf(stderr, "Could not open %s for writing\n", file.c_str());
+    return false;
+  }
+  std::string prefix(MAGIC, 8);
+  AppendUint32(BUNDLE_FORMAT_VERSION, &prefix);
+  AppendUint32(header.size(), &prefix);
+  bool ok = fwrite(prefix.data(), 1, prefix.size(), fp) == prefix.size() &&
+            fwrite(header.data(), 1, header.size(), fp) == header.size();
+  const std::string zeros(ALIGNMENT, '\0');
+  for (const Array& array : arrays_) {
+    if (!ok) break;
+    const size_t padding = Padding(array.bytes.size());
+    ok = fwrite(array.bytes.data(), 1, array.bytes.size(), fp) ==
+             array.bytes.size() &&
+         fwrite(zeros.data(), 1, padding, fp) == padding;
+  }
+  if (fclose(fp) != 0) {
+    ok = false;
+  }
+  if (!ok) {
+    fprintf(stderr, "Error writing %s\n", file.c_str());
+  }
+  return ok;
+}
+
+}  // namespace lufz
@@ -0,0 +1,78 @@
+#ifndef LUFZ_BUNDLE_H_
+#define LUFZ_BUNDLE_H_
+
+/**
+ * A binary bundle of named arrays, meant to be loaded in a browser into a
+ * single ArrayBuffer and viewed through typed arrays, with no parsing other
+ * than that of a small JSON header. See lufz-lexicon-bundle.js for the
+ * reference loader.
+ *
+ * Layout (all integers are little-endian):
+ *   "LUFZBNDL"                (8 bytes)
+ *   format version            (uint32)
+ *   header length in bytes    (uint32)
+ *   header                    (UTF-8 JSON, space-padded to a multiple of 8)
+ *   arrays                    (each starting at a multiple of 8)
+ * The header is a JSON object with the metadata fields set with
+ * SetString() and SetStrings(), and an "arrays" field that maps each array
+ * name to {"type": <"Uint8"|"Uint16"|"Int32"|"Uint32">, "offset": <byte
+ * offset from the start of the bundle>, "length": <number of elements>}.
+ */
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+namespace lufz {
+
+const int BUNDLE_FORMAT_VERSION = 1;
+
+class BundleWriter {
+ public:
+  BundleWriter();
+
+  void SetString(const std::string& name, const std::string& value);
+  void SetStrings(const std::string& name,
+                  const std::vector<std::string>& values);
+
+  void AddUint8(const std::string& name, const std::vector<uint8_t>& values);
+  void AddUint16(const std::string& name, const std::vector<uint16_t>& values);
+  void AddInt32(const std::string& name, const std::vector<int32_t>& values);
+  void AddUint32(const std::string& name, const std::vector<uint32_t>& values);
+
+  /**
+   * Adds a string table as two arrays: <name>.bytes (Uint8, the strings
+   * concatenated) and <name>.offsets (Uint32, with offsets[i] and
+   * offsets[i + 1] delimiting the i'th string).
+   */
+  void AddStrings(const std::string& name,
+                  const std::vector<std::string>& strings);
+
+  /**
+   * Writes the bundle to file. Returns false (after complaining) on errors.
+   */
+  bool Write(const std::string& file) const;
+
+  int64_t NumArrayBytes() const {
+    return num_array_bytes_;
+  }
+
+ private:
+  struct Array {
+    std::string name;
+    std::string type;
+    int64_t length;
+    std::string bytes;
+  };
+  void AddArray(const std::string& name, const std::string& type,
+                const void* data, int64_t length, int element_size);
+
+  std::string metadata_;  // JSON fields, each followed by ", ".
+  std::vector<Array> arrays_;
+  int64_t num_array_bytes_;
+};
+
+}  // namespace lufz
+
+#endif  // LUFZ_BUNDLE_H_
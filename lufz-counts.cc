@@ -0,0 +1,260 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <charconv>
+#include <string>
+#include <vector>
+
+#include "lufz-counts.h"
+#include "lufz-util.h"
+
+namespace lufz {
+
+namespace {
+/**
+ * Version 2 added doc_counts and open_doc_phrases (we can still read
+ * version 1 files).
+ */
+const char COUNTS_MAGIC[] = "LUFZCNT2";
+const char COUNTS_MAGIC_V1[] = "LUFZCNT1";
+const size_t COUNTS_MAGIC_LEN = 8;
+
+bool WriteInt64(FILE* fp, int64_t v) {
+  return fwrite(&v, sizeof(v), 1, fp) == 1;
+}
+
+bool ReadInt64(FILE* fp, int64_t* v) {
+  return fread(v, sizeof(*v), 1, fp) == 1;
+}
+
+/**
+ * The number of bytes in fp past the current position, so that sizes read
+ * from a corrupt file can be checked before allocating for them.
+ */
+int64_t BytesLeft(FILE* fp) {
+  struct stat st;
+  const int64_t pos = ftello(fp);
+  if (pos < 0 || fstat(fileno(fp), &st) != 0) {
+    return 0;
+  }
+  return std::max<int64_t>(0, st.st_size - pos);
+}
+
+bool WriteInt64s(FILE* fp, const std::vector<int64_t>& v) {
+  return WriteInt64(fp, v.size()) &&
+         (v.empty() ||
+          fwrite(v.data(), sizeof(int64_t), v.size(), fp) == v.size());
+}
+
+bool ReadInt64s(FILE* fp, std::vector<int64_t>* v) {
+  int64_t size = 0;
+  if (!ReadInt64(fp, &size) || size < 0 ||
+      size > BytesLeft(fp) / int64_t(sizeof(int64_t))) {
+    return false;
+  }
+  v->resize(size);
+  return fread(v->data(), sizeof(int64_t), size, fp) == size_t(size);
+}
+}  // namespace
+
+void DocFreqCounter::Apply(const std::vector<int>& hits,
+                           const std::vector<size_t>& doc_starts,
+                           std::vector<int64_t>* doc_counts) {
+  size_t next_doc = 0;
+  for (size_t h = 0; h <= hits.size(); ++h) {
+    while (next_doc < doc_starts.size() && doc_starts[next_doc] == h) {
+      ++doc_epoch_;
+      ++next_doc;
+    }
+    if (h == hits.size()) {
+      break;
+    }
+    const int idx = hits[h];
+    if (doc_last_seen_[idx] != doc_epoch_) {
+      doc_last_seen_[idx] = doc_epoch_;
+      (*doc_counts)[idx]++;
+    }
+  }
+}
+
+void DocFreqCounter::Snapshot(std::vector<int64_t>* open_doc_phrases) const {
+  open_doc_phrases->clear();
+  for (size_t i = 0; i < doc_last_seen_.size(); ++i) {
+    if (doc_last_seen_[i] == doc_epoch_) {
+      open_doc_phrases->push_back(i);
+    }
+  }
+}
+
+bool DocFreqCounter::Restore(const std::vector<int64_t>& open_doc_phrases) {
+  for (int64_t idx : open_doc_phrases) {
+    if (idx < 0 || idx >= int64_t(doc_last_seen_.size())) {
+      return false;
+    }
+    doc_last_seen_[idx] = doc_epoch_;
+  }
+  return true;
+}
+
+uint64_t LexiconFingerprint(const Lexicon& lexicon) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (const PhraseInfo& phrase_info : lexicon.phrase_infos) {
+    for (unsigned char c : phrase_info.normalized) {
+      hash ^= c;
+      hash *= 1099511628211ULL;
+    }
+    // Separator, so that {"AB", "C"} and {"A", "BC"} differ.
+    hash ^= '\n';
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+bool WritePopularityCounts(const char* file, const PopularityCounts& counts) {
+  const std::string tmp_file = std::string(file) + ".tmp";
+  FILE* fp = fopen(tmp_file.c_str(), "wb");
+  if (!fp) {
+    fprintf(stderr, "Could not open %s\n", tmp_file.c_str());
+    return false;
+  }
+  bool ok = fwrite(COUNTS_MAGIC, COUNTS_MAGIC_LEN, 1, fp) == 1 &&
+            WriteInt64(fp, counts.fingerprint) &&
+            WriteInt64(fp, counts.input_offset) &&
+            WriteInt64(fp, counts.num_lines) &&
+            WriteInt64(fp, counts.num_doc_lines) &&
+            WriteInt64(fp, counts.num_probes) &&
+            WriteInt64(fp, counts.num_hits) &&
+            WriteInt64s(fp, counts.counts) &&
+            WriteInt64s(fp, counts.doc_counts) &&
+            WriteInt64s(fp, counts.open_doc_phrases);
+  ok = (fflush(fp) == 0) && ok;
+  ok = (fsync(fileno(fp)) == 0) && ok;
+  ok = (fclose(fp) == 0) && ok;
+  if (!ok) {
+    fprintf(stderr, "Error writing %s\n", tmp_file.c_str());
+    return false;
+  }
+  if (rename(tmp_file.c_str(), file) != 0) {
+    fprintf(stderr, "Could not rename %s to %s\n", tmp_file.c_str(), file);
+    return false;
+  }
+  return true;
+}
+
+bool ReadPopularityCounts(const char* file, PopularityCounts* counts) {
+  FILE* fp = fopen(file, "rb");
+  if (!fp) {
+    fprintf(stderr, "Could not open %s\n", file);
+    return false;
+  }
+  char magic[COUNTS_MAGIC_LEN];
+  int64_t fingerprint = 0;
+  bool ok = fread(magic, COUNTS_MAGIC_LEN, 1, fp) == 1;
+  const bool v1 = ok && !memcmp(magic, COUNTS_MAGIC_V1, COUNTS_MAGIC_LEN);
+  ok = ok && (v1 || !memcmp(magic, COUNTS_MAGIC, COUNTS_MAGIC_LEN)) &&
+       ReadInt64(fp, &fingerprint) &&
+       ReadInt64(fp, &counts->input_offset) &&
+       ReadInt64(fp, &counts->num_lines) &&
+       ReadInt64(fp, &counts->num_doc_lines) &&
+       ReadInt64(fp, &counts->num_probes) &&
+       ReadInt64(fp, &counts->num_hits) &&
+       ReadInt64s(fp, &counts->counts);
+  counts->doc_counts.clear();
+  counts->open_doc_phrases.clear();
+  if (ok && !v1) {
+    ok = ReadInt64s(fp, &counts->doc_counts) &&
+         ReadInt64s(fp, &counts->open_doc_phrases);
+  }
+  counts->fingerprint = fingerprint;
+  fclose(fp);
+  if (!ok) {
+    fprintf(stderr, "%s is not a valid counts file\n", file);
+    return false;
+  }
+  return true;
+}
+
+bool AddPopularityCounts(const PopularityCounts& shard, PopularityCounts* total) {
+  if (total->counts.empty()) {
+    total->fingerprint = shard.fingerprint;
+  } else if (total->fingerprint != shard.fingerprint) {
+    return false;
+  }
+  if (total->counts.size() < shard.counts.size()) {
+    total->counts.resize(shard.counts.size());
+  }
+  for (size_t i = 0; i < shard.counts.size(); ++i) {
+    total->counts[i] += shard.counts[i];
+  }
+  if (total->doc_counts.size() < shard.doc_counts.size()) {
+    total->doc_counts.resize(shard.doc_counts.size());
+  }
+  for (size_t i = 0; i < shard.doc_counts.size(); ++i) {
+    total->doc_counts[i] += shard.doc_counts[i];
+  }
+  total->num_lines += shard.num_lines;
+  total->num_doc_lines += shard.num_doc_lines;
+  total->num_probes += shard.num_probes;
+  total->num_hits += shard.num_hits;
+  return true;
+}
+
+void ApplyPopularityCounts(const PopularityCounts& counts, Lexicon* lexicon,
+                           bool use_doc_counts) {
+  const std::vector<int64_t>& v =
+      use_doc_counts ? counts.doc_counts : counts.counts;
+  for (size_t i = 0; i < lexicon->phrase_infos.size(); ++i) {
+    lexicon->phrase_infos[i].importance = 1 + (i < v.size() ? v[i] : 0);
+  }
+}
+
+void PrintImportances(Lexicon* lexicon, FILE* fp) {
+  sort(lexicon->phrase_infos.begin() + 1, lexicon->phrase_infos.end(),
+       [](const PhraseInfo& a, const PhraseInfo& b) -> bool {
+         return a.importance > b.importance;
+       });
+  if (lexicon->phrase_infos.size() > 1) {
+    lexicon->phrase_infos[0].importance = std::max(
+        lexicon->phrase_infos[0].importance,
+        lexicon->phrase_infos[1].importance + 1);
+  }
+  int base_index = 0;
+  for (size_t i = 0; i < lexicon->phrase_infos.size(); i++) {
+    lexicon->phrase_infos[i].base_index = base_index;
+    base_index += lexicon->phrase_infos[i].forms.size();
+  }
+
+  // Importances that are whole numbers (as they are when they come from
+  // counts) are formatted as integers, avoiding long double formatting.
+  std::string out;
+  char importance[64];
+  for (const auto& phrase_info : lexicon->phrase_infos) {
+    const long double value = phrase_info.importance;
+    size_t len;
+    if (value >= 0 && value < 1e18 && value == int64_t(value)) {
+      len = std::to_chars(importance, importance + sizeof(importance),
+                          int64_t(value)).ptr - importance;
+      importance[len++] = '.';
+      importance[len++] = '0';
+    } else {
+      len = snprintf(importance, sizeof(importance), "%.1Lf", value);
+    }
+    for (const auto& form : phrase_info.forms) {
+      out.append(importance, len);
+      out += '\t';
+      out += form;
+      out += '\n';
+    }
+    if (out.size() >= (1 << 20)) {
+      fwrite(out.data(), 1, out.size(), fp);
+      out.clear();
+    }
+  }
+  fwrite(out.data(), 1, out.size(), fp);
+}
+
+}  // namespace lufz
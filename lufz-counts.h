@@ -0,0 +1,130 @@
+#ifndef LUFZ_COUNTS_H_
+#define LUFZ_COUNTS_H_
+
+/**
+ * Binary snapshots of add-wiki-popularity's per-phrase occurrence counts,
+ * used for checkpointing long runs and resuming them, and as count shards
+ * (over parts of a corpus, or over different corpora) that get summed up
+ * by merge-popularity-shards.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <vector>
+
+#include "lufz-util.h"
+
+namespace lufz {
+
+struct PopularityCounts {
+  /**
+   * LexiconFingerprint() of the lexicon that the counts are indexed by.
+   */
+  uint64_t fingerprint;
+  /**
+   * Byte offset in the corpus just past the last line counted.
+   */
+  int64_t input_offset;
+  int64_t num_lines;
+  int64_t num_doc_lines;
+  int64_t num_probes;
+  int64_t num_hits;
+  /**
+   * counts[i] is the number of corpus hits for Lexicon.phrase_infos[i].
+   */
+  std::vector<int64_t> counts;
+  /**
+   * doc_counts[i] is the number of corpus documents that have at least one
+   * hit for Lexicon.phrase_infos[i]. Empty if document frequencies are not
+   * being counted.
+   */
+  std::vector<int64_t> doc_counts;
+  /**
+   * Lexicon indices already counted in doc_counts for the document that
+   * was still open when the counts were saved.
+   */
+  std::vector<int64_t> open_doc_phrases;
+  PopularityCounts() :
+    fingerprint(0),
+    input_offset(0),
+    num_lines(0),
+    num_doc_lines(0),
+    num_probes(0),
+    num_hits(0) {}
+};
+
+/**
+ * Document frequency counting: each phrase is counted at most once per
+ * document. Instead of a per-document set, doc_last_seen_[i] holds the
+ * epoch (document number) in which phrase i was last counted, so nothing
+ * needs to be allocated or cleared when a new document starts.
+ */
+class DocFreqCounter {
+ public:
+  explicit DocFreqCounter(size_t num_phrases) :
+    doc_last_seen_(num_phrases, -1), doc_epoch_(0) {}
+
+  /**
+   * Adds to *doc_counts the lexicon indices in hits (in corpus order),
+   * where a new document starts before hits[doc_starts[k]] for each k
+   * (doc_starts[k] may be hits.size(), and is non-decreasing).
+   */
+  void Apply(const std::vector<int>& hits,
+             const std::vector<size_t>& doc_starts,
+             std::vector<int64_t>* doc_counts);
+
+  /**
+   * Sets *open_doc_phrases to the phrases already counted in the current
+   * document, and Restore() marks them as counted again (on resuming). It
+   * returns false if any of them is out of range.
+   */
+  void Snapshot(std::vector<int64_t>* open_doc_phrases) const;
+  bool Restore(const std::vector<int64_t>& open_doc_phrases);
+
+ private:
+  std::vector<int64_t> doc_last_seen_;
+  int64_t doc_epoch_;
+};
+
+/**
+ * A 64-bit FNV-1a hash of the normalized phrases of the lexicon, in order.
+ * Counts are only meaningful against a lexicon with the same fingerprint.
+ */
+uint64_t LexiconFingerprint(const Lexicon& lexicon);
+
+/**
+ * Writes counts to file atomically: the data goes to "<file>.tmp", which is
+ * flushed to disk and then renamed to file. So, file always holds either
+ * the previous or the new snapshot, even if the process gets killed.
+ */
+bool WritePopularityCounts(const char* file, const PopularityCounts& counts);
+
+/**
+ * Reads a file written by WritePopularityCounts().
+ */
+bool ReadPopularityCounts(const char* file, PopularityCounts* counts);
+
+/**
+ * Adds the counts (and the line/probe/hit totals) from shard into *total.
+ * total->counts is sized as needed. Returns false if the fingerprints do not
+ * match (a total with an empty counts vector takes on shard's fingerprint).
+ */
+bool AddPopularityCounts(const PopularityCounts& shard, PopularityCounts* total);
+
+/**
+ * Sets the importance of each phrase in lexicon to 1 + its count (or its
+ * document frequency, if use_doc_counts is set).
+ */
+void ApplyPopularityCounts(const PopularityCounts& counts, Lexicon* lexicon,
+                           bool use_doc_counts = false);
+
+/**
+ * Sorts lexicon by decreasing importance and prints it to fp in the
+ * "<importance>\t<form>" format that ReadLexicon() accepts.
+ */
+void PrintImportances(Lexicon* lexicon, FILE* fp);
+
+}  // namespace lufz
+
+#endif  // LUFZ_COUNTS_H_
@@ -0,0 +1,83 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "lufz-cuckoo.h"
+
+namespace lufz {
+
+CuckooFilter::CuckooFilter(size_t memory_bytes)
+    : size_(0), num_resets_(0), rng_(0x9e3779b97f4a7c15ULL) {
+  size_t num_buckets = 1;
+  while (num_buckets * 2 * SLOTS_PER_BUCKET * sizeof(uint32_t) <=
+         memory_bytes) {
+    num_buckets *= 2;
+  }
+  bucket_mask_ = num_buckets - 1;
+  slots_.assign(num_buckets * SLOTS_PER_BUCKET, 0);
+}
+
+void CuckooFilter::Clear() {
+  std::fill(slots_.begin(), slots_.end(), 0);
+  size_ = 0;
+}
+
+size_t CuckooFilter::AltBucket(size_t bucket, uint32_t fingerprint) const {
+  return (bucket ^ (fingerprint * 0x5bd1e995ULL)) & bucket_mask_;
+}
+
+bool CuckooFilter::Contains(size_t bucket, uint32_t fingerprint) const {
+  const uint32_t* slots = &slots_[bucket * SLOTS_PER_BUCKET];
+  for (int i = 0; i < SLOTS_PER_BUCKET; ++i) {
+    if (slots[i] == fingerprint) return true;
+  }
+  return false;
+}
+
+bool CuckooFilter::InsertInto(size_t bucket, uint32_t fingerprint) {
+  uint32_t* slots = &slots_[bucket * SLOTS_PER_BUCKET];
+  for (int i = 0; i < SLOTS_PER_BUCKET; ++i) {
+    if (slots[i] == 0) {
+      slots[i] = fingerprint;
+      ++size_;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool CuckooFilter::TestAndInsert(uint64_t hash) {
+  uint32_t fingerprint = hash >> 32;
+  if (fingerprint == 0) fingerprint = 1;
+  size_t bucket = hash & bucket_mask_;
+  const size_t alt_bucket = AltBucket(bucket, fingerprint);
+  if (Contains(bucket, fingerprint) || Contains(alt_bucket, fingerprint)) {
+    return true;
+  }
+  if (InsertInto(bucket, fingerprint) || InsertInto(alt_bucket, fingerprint)) {
+    return false;
+  }
+  // Kick out random residents to their alternate buckets.
+  for (int kick = 0; kick < MAX_KICKS; ++kick) {
+    rng_ ^= rng_ << 13;
+    rng_ ^= rng_ >> 7;
+    rng_ ^= rng_ << 17;
+    std::swap(fingerprint, slots_[bucket * SLOTS_PER_BUCKET +
+                                  rng_ % SLOTS_PER_BUCKET]);
+    bucket = AltBucket(bucket, fingerprint);
+    if (InsertInto(bucket, fingerprint)) {
+      return false;
+    }
+  }
+  // Full: start afresh.
+  Clear();
+  ++num_resets_;
+  InsertInto(hash & bucket_mask_, hash >> 32 ? hash >> 32 : 1);
+  return false;
+}
+
+}  // namespace lufz
@@ -0,0 +1,58 @@
+#ifndef LUFZ_CUCKOO_H_
+#define LUFZ_CUCKOO_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <string>
+#include <vector>
+
+namespace lufz {
+
+/**
+ * A cuckoo filter over 64-bit hashes, with 32-bit fingerprints in buckets
+ * of 4 slots, using a fixed amount of memory. Used by add-wiki-popularity
+ * to spot repeated corpus lines. False positives (a new hash reported as
+ * seen) happen with a probability of about 2e-9 per lookup. If the filter
+ * fills up, it gets cleared and starts afresh.
+ */
+class CuckooFilter {
+ public:
+  explicit CuckooFilter(size_t memory_bytes);
+
+  /**
+   * Returns true if hash has (probably) been inserted earlier. Otherwise,
+   * inserts it and returns false.
+   */
+  bool TestAndInsert(uint64_t hash);
+
+  void Clear();
+
+  size_t Size() const {
+    return size_;
+  }
+  size_t Capacity() const {
+    return slots_.size();
+  }
+  int64_t NumResets() const {
+    return num_resets_;
+  }
+
+ private:
+  static const int SLOTS_PER_BUCKET = 4;
+  static const int MAX_KICKS = 500;
+
+  bool Contains(size_t bucket, uint32_t fingerprint) const;
+  bool InsertInto(size_t bucket, uint32_t fingerprint);
+  size_t AltBucket(size_t bucket, uint32_t fingerprint) const;
+
+  size_t bucket_mask_;
+  std::vector<uint32_t> slots_;  // 0 means empty.
+  size_t size_;
+  int64_t num_resets_;
+  uint64_t rng_;
+};
+
+}  // namespace lufz
+
+#endif  // LUFZ_CUCKOO_H_
@@ -0,0 +1,226 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+
+#include "lufz-gzip.h"
+
+namespace lufz {
+
+namespace {
+const size_t DICTIONARY_SIZE = 32 << 10;
+
+void AppendUint32(uint32_t value, std::string* bytes) {
+  for (int i = 0; i < 4; ++i) {
+    *bytes += char((value >> (8 * i)) & 0xff);
+  }
+}
+}  // namespace
+
+GzipWriter::GzipWriter(int num_threads, int level)
+    : num_threads_(std::max(num_threads, 1)),
+      level_(level),
+      fp_(nullptr),
+      crc_(crc32(0, nullptr, 0)),
+      num_bytes_in_(0),
+      num_bytes_out_(0),
+      failed_(false),
+      next_(0),
+      stopping_(false) {}
+
+GzipWriter::~GzipWriter() {
+  if (fp_) {
+    Close();
+  }
+}
+
+bool GzipWriter::Open(const std::string& file) {
+  fp_ = fopen(file.c_str(), "wb");
+  if (!fp_) {
+    fprintf(stderr, "Could not open %s for writing\n", file.c_str());
+    return false;
+  }
+  file_ = file;
+  // A minimal gzip header: magic, deflate, no flags, no mtime, unknown OS.
+  const unsigned char header[10] = {0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 0xff};
+  if (fwrite(header, 1, sizeof(header), fp_) != sizeof(header)) {
+    fprintf(stderr, "Error writing %s\n", file_.c_str());
+    failed_ = true;
+  }
+  num_bytes_out_ = sizeof(header);
+  for (int t = 0; t < num_threads_; ++t) {
+    workers_.push_back(std::thread(&GzipWriter::Work, this));
+  }
+  return !failed_;
+}
+
+void GzipWriter::Write(std::string_view data) {
+  num_bytes_in_ += data.size();
+  while (!data.empty()) {
+    const size_t n = std::min(data.size(), BLOCK_SIZE - pending_.size());
+    pending_.append(data.data(), n);
+    data.remove_prefix(n);
+    if (pending_.size() == BLOCK_SIZE) {
+      Submit(false);
+    }
+  }
+}
+
+void GzipWriter::Submit(bool last) {
+  std::unique_ptr<Block> block(new Block);
+  block->input.swap(pending_);
+  block->dictionary = dictionary_;
+  block->last = last;
+  block->done = false;
+  const size_t keep = std::min(block->input.size(), DICTIONARY_SIZE);
+  if (keep == DICTIONARY_SIZE) {
+    dictionary_.assign(block->input, block->input.size() - keep, keep);
+  } else {
+    dictionary_ = dictionary_.substr(
+        dictionary_.size() - std::min(dictionary_.size(),
+                                      DICTIONARY_SIZE - keep)) +
+        block->input;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    blocks_.push_back(std::move(block));
+  }
+  work_cv_.notify_one();
+  // Write out what is done, and keep at most two blocks per thread in
+  // flight, so that memory use stays bounded.
+  WriteDone(false);
+  while (!last && blocks_.size() > 2 * size_t(num_threads_)) {
+    WriteDone(true);
+  }
+}
+
+void GzipWriter::WriteDone(bool wait) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (wait) {
+    done_cv_.wait(lock, [this] { return blocks_.front()->done; });
+  }
+  while (!blocks_.empty() && blocks_.front()->done) {
+    std::unique_ptr<Block> block = std::move(blocks_.front());
+    blocks_.pop_front();
+    --next_;
+    lock.unlock();
+    if (!block->error.empty()) {
+      if (!failed_) {
+        fprintf(stderr, "Error compressing %s: %s\n", file_.c_str(),
+                block->error.c_str());
+      }
+      failed_ = true;
+    } else if (!failed_ &&
+               fwrite(block->output.data(), 1, block->output.size(), fp_) !=
+                   block->output.size()) {
+      fprintf(stderr, "Error writing %s\n", file_.c_str());
+      failed_ = true;
+    }
+    num_bytes_out_ += block->output.size();
+    crc_ = crc32_combine(crc_, block->crc, block->input.size());
+    lock.lock();
+  }
+}
+
+void GzipWriter::Work() {
+  while (true) {
+    Block* block;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      work_cv_.wait(lock, [this] {
+        return stopping_ || next_ < blocks_.size();
+      });
+      if (next_ >= blocks_.size()) {
+        return;
+      }
+      block = blocks_[next_++].get();
+    }
+    Deflate(block);
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      block->done = true;
+    }
+    done_cv_.notify_all();
+  }
+}
+
+void GzipWriter::Deflate(Block* block) {
+  block->crc = crc32(0, reinterpret_cast<const Bytef*>(block->input.data()),
+                     block->input.size());
+  z_stream zs = {};
+  // Raw deflate: the gzip header and trailer are written separately.
+  int status = deflateInit2(&zs, level_, Z_DEFLATED, -15, 8,
+                            Z_DEFAULT_STRATEGY);
+  if (status != Z_OK) {
+    block->error = zs.msg ? zs.msg : zError(status);
+    return;
+  }
+  if (!block->dictionary.empty()) {
+    status = deflateSetDictionary(
+        &zs, reinterpret_cast<const Bytef*>(block->dictionary.data()),
+        block->dictionary.size());
+  }
+  block->output.resize(deflateBound(&zs, block->input.size()) + 16);
+  zs.next_in = reinterpret_cast<Bytef*>(block->input.data());
+  zs.avail_in = block->input.size();
+  zs.next_out = reinterpret_cast<Bytef*>(block->output.data());
+  zs.avail_out = block->output.size();
+  // Z_SYNC_FLUSH ends a block on a byte boundary, so that the next block
+  // can be appended to it. The output buffer is big enough for everything,
+  // so this should use up all the input in one call (and end the stream,
+  // with Z_FINISH).
+  if (status == Z_OK) {
+    const bool last = block->last;
+    status = deflate(&zs, last ? Z_FINISH : Z_SYNC_FLUSH);
+    if (status == (last ? Z_STREAM_END : Z_OK) && zs.avail_in == 0) {
+      status = Z_OK;
+    } else if (status == Z_OK || status == Z_STREAM_END) {
+      status = Z_BUF_ERROR;
+    }
+  }
+  if (status != Z_OK) {
+    block->error = zs.msg ? zs.msg : zError(status);
+  }
+  block->output.resize(zs.total_out);
+  deflateEnd(&zs);
+}
+
+bool GzipWriter::Close() {
+  if (!fp_) {
+    return false;
+  }
+  Submit(true);
+  while (!blocks_.empty()) {
+    WriteDone(true);
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  work_cv_.notify_all();
+  for (std::thread& worker : workers_) {
+    worker.join();
+  }
+  workers_.clear();
+  std::string trailer;
+  AppendUint32(crc_, &trailer);
+  AppendUint32(uint32_t(num_bytes_in_), &trailer);
+  if (fwrite(trailer.data(), 1, trailer.size(), fp_) != trailer.size() ||
+      fclose(fp_) != 0) {
+    if (!failed_) {
+      fprintf(stderr, "Error writing %s\n", file_.c_str());
+    }
+    failed_ = true;
+  }
+  num_bytes_out_ += trailer.size();
+  fp_ = nullptr;
+  return !failed_;
+}
+
+}  // namespace lufz
@@ -0,0 +1,94 @@
+#ifndef LUFZ_GZIP_H_
+#define LUFZ_GZIP_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+namespace lufz {
+
+/**
+ * Writes a gzip file, compressing it in parallel like pigz does: the data
+ * is cut into blocks of BLOCK_SIZE bytes, and each block is deflated
+ * independently on a worker thread (using the last 32KB of the previous
+ * block as its dictionary, so that little compression is lost). The
+ * deflated blocks are written out in order, as a single gzip member, by
+ * the thread that calls Write().
+ */
+class GzipWriter {
+ public:
+  static const size_t BLOCK_SIZE = 1 << 20;
+
+  GzipWriter(int num_threads, int level);
+  ~GzipWriter();
+
+  bool Open(const std::string& file);
+  void Write(std::string_view data);
+  /**
+   * Compresses and writes whatever is left, and the gzip trailer. Returns
+   * false if there have been any errors.
+   */
+  bool Close();
+
+  int64_t NumBytesIn() const {
+    return num_bytes_in_;
+  }
+  int64_t NumBytesOut() const {
+    return num_bytes_out_;
+  }
+
+ private:
+  struct Block {
+    std::string input;
+    std::string dictionary;
+    bool last;
+    std::string output;
+    uint32_t crc;
+    // zlib's error message, if deflating failed.
+    std::string error;
+    bool done;
+  };
+
+  void Submit(bool last);
+  /**
+   * Writes out the done blocks at the front of blocks_. With wait, first
+   * waits for the front block to be done.
+   */
+  void WriteDone(bool wait);
+  void Work();
+  // Sets block->error if zlib fails.
+  void Deflate(Block* block);
+
+  const int num_threads_;
+  const int level_;
+  FILE* fp_;
+  std::string file_;
+  std::string pending_;
+  std::string dictionary_;
+  uint32_t crc_;
+  int64_t num_bytes_in_;
+  int64_t num_bytes_out_;
+  bool failed_;
+
+  std::mutex mutex_;
+  std::condition_variable work_cv_;
+  std::condition_variable done_cv_;
+  // Blocks not yet written out, in order. The first next_ of them have
+  // been picked up by workers.
+  std::deque<std::unique_ptr<Block>> blocks_;
+  size_t next_;
+  bool stopping_;
+  std::vector<std::thread> workers_;
+};
+
+}  // namespace lufz
+
+#endif  // LUFZ_GZIP_H_
@@ -0,0 +1,280 @@
+#include <stdint.h>
+#include <stdio.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "lufz-keys.h"
+#include "lufz-util.h"
+
+namespace lufz {
+
+namespace {
+struct ByteMasks {
+  uint64_t masks[256];
+  ByteMasks() {
+    for (int m = 0; m < 256; ++m) {
+      masks[m] = 0;
+      for (int i = 0; i < 8; ++i) {
+        if (m & (1 << i)) {
+          masks[m] |= uint64_t(0xff) << (8 * i);
+        }
+      }
+    }
+  }
+};
+const ByteMasks byte_masks;
+
+const size_t RUN_CHUNK_PAIRS = 1 << 16;
+}  // namespace
+
+const uint64_t* const WildKeyEncoder::BYTE_MASKS = byte_masks.masks;
+
+WildKeyEncoder::WildKeyEncoder() {
+  letters_.push_back("?");
+}
+
+bool WildKeyEncoder::Encode(const std::vector<std::string>& key_parts,
+                            WildKey* key) {
+  const int len = key_parts.size();
+  key->lo = 0;
+  key->hi = uint64_t(len) << 32;
+  for (int i = 0; i < len && i < WILDIZE_ALL_BEYOND; ++i) {
+    auto it = letter_ids_.find(key_parts[i]);
+    int id;
+    if (it != letter_ids_.end()) {
+      id = it->second;
+    } else {
+      id = letters_.size();
+      if (id > 0xff) {
+        fprintf(stderr, "Too many distinct letters for WildKey at [%s]\n",
+                key_parts[i].c_str());
+        return false;
+      }
+      letter_ids_[key_parts[i]] = id;
+      letters_.push_back(key_parts[i]);
+    }
+    if (i < 8) {
+      key->lo |= uint64_t(id) << (8 * i);
+    } else {
+      key->hi |= uint64_t(id) << (8 * (i - 8));
+    }
+  }
+  return true;
+}
+
+std::string WildKeyEncoder::ToString(const WildKey& key) const {
+  std::string s;
+  const int len = key.Length();
+  for (int i = 0; i < len; ++i) {
+    int id = 0;
+    if (i < 8) {
+      id = (key.lo >> (8 * i)) & 0xff;
+    } else if (i < WILDIZE_ALL_BEYOND) {
+      id = (key.hi >> (8 * (i - 8))) & 0xff;
+    }
+    s += letters_[id];
+  }
+  return s;
+}
+
+WildKeyMap::WildKeyMap() : slots_(1024, Slot{{0, 0}, 0}), mask_(1023),
+                           size_(0) {}
+
+void WildKeyMap::Add(const WildKey& key, int64_t delta) {
+  size_t i = key.Hash() & mask_;
+  while (slots_[i].value > 0) {
+    if (slots_[i].key == key) {
+      slots_[i].value += delta;
+      return;
+    }
+    i = (i + 1) & mask_;
+  }
+  slots_[i].key = key;
+  slots_[i].value = delta;
+  if (++size_ * 2 > slots_.size()) {
+    Grow();
+  }
+}
+
+int64_t WildKeyMap::Find(const WildKey& key) const {
+  size_t i = key.Hash() & mask_;
+  while (slots_[i].value > 0) {
+    if (slots_[i].key == key) {
+      return slots_[i].value;
+    }
+    i = (i + 1) & mask_;
+  }
+  return 0;
+}
+
+void WildKeyMap::Grow() {
+  std::vector<Slot> old_slots(2 * slots_.size(), Slot{{0, 0}, 0});
+  old_slots.swap(slots_);
+  mask_ = slots_.size() - 1;
+  for (const Slot& slot : old_slots) {
+    if (slot.value > 0) {
+      size_t i = slot.key.Hash() & mask_;
+      while (slots_[i].value > 0) {
+        i = (i + 1) & mask_;
+      }
+      slots_[i] = slot;
+    }
+  }
+}
+
+KeyPhraseSorter::KeyPhraseSorter(size_t max_buffered, int num_threads)
+    : max_buffered_(std::max(max_buffered, size_t(1))),
+      num_threads_(std::max(num_threads, 1)),
+      buffer_pos_(0),
+      num_pairs_(0),
+      failed_(false) {}
+
+KeyPhraseSorter::~KeyPhraseSorter() {
+  for (Run& run : runs_) {
+    fclose(run.fp);
+  }
+}
+
+void KeyPhraseSorter::Sort() {
+  const size_t n = buffer_.size();
+  scratch_.resize(n);
+  // Each thread takes a contiguous chunk, and within each bucket, the
+  // chunks are laid out in order, so the sort is stable.
+  const int num_threads = std::min(size_t(num_threads_), n / 65536 + 1);
+  std::vector<std::vector<size_t>> counts(num_threads,
+                                          std::vector<size_t>(256));
+  // LSD radix sort on the bytes of lo and then hi, so that the pairs end up
+  // sorted by (hi, lo). Bytes that are the same for all pairs are skipped.
+  for (int byte = 0; byte < 12; ++byte) {
+    const int shift = byte < 8 ? 8 * byte : 8 * (byte - 8);
+    const bool use_lo = byte < 8;
+    auto digit = [shift, use_lo](const KeyPhrase& pair) -> int {
+      return ((use_lo ? pair.lo : pair.hi) >> shift) & 0xff;
+    };
+    RunOnThreads(num_threads, [&](int t) {
+      std::vector<size_t>& c = counts[t];
+      std::fill(c.begin(), c.end(), 0);
+      for (size_t i = n * t / num_threads; i < n * (t + 1) / num_threads;
+           ++i) {
+        c[digit(buffer_[i])]++;
+      }
+    });
+    bool trivial = false;
+    size_t next = 0;
+    for (int b = 0; b < 256; ++b) {
+      size_t bucket_size = 0;
+      for (int t = 0; t < num_threads; ++t) {
+        const size_t c = counts[t][b];
+        counts[t][b] = next;
+        next += c;
+        bucket_size += c;
+      }
+      trivial = trivial || (bucket_size == n);
+    }
+    if (trivial) {
+      continue;
+    }
+    RunOnThreads(num_threads, [&](int t) {
+      std::vector<size_t>& offsets = counts[t];
+      for (size_t i = n * t / num_threads; i < n * (t + 1) / num_threads;
+           ++i) {
+        scratch_[offsets[digit(buffer_[i])]++] = buffer_[i];
+      }
+    });
+    buffer_.swap(scratch_);
+  }
+}
+
+bool KeyPhraseSorter::Spill() {
+  Sort();
+  FILE* fp = tmpfile();
+  if (!fp) {
+    fprintf(stderr, "Could not create a temporary file for sorted pairs\n");
+    failed_ = true;
+    return false;
+  }
+  runs_.push_back({fp, {}, 0});
+  num_pairs_ += buffer_.size();
+  if (fwrite(buffer_.data(), sizeof(KeyPhrase), buffer_.size(), fp) !=
+      buffer_.size()) {
+    fprintf(stderr, "Error writing sorted pairs to a temporary file\n");
+    failed_ = true;
+    return false;
+  }
+  buffer_.clear();
+  return true;
+}
+
+bool KeyPhraseSorter::Refill(Run* run) {
+  run->chunk.resize(RUN_CHUNK_PAIRS);
+  const size_t got = fread(run->chunk.data(), sizeof(KeyPhrase),
+                           RUN_CHUNK_PAIRS, run->fp);
+  if (ferror(run->fp)) {
+    fprintf(stderr, "Error reading sorted pairs from a temporary file\n");
+    failed_ = true;
+  }
+  run->chunk.resize(got);
+  run->pos = 0;
+  return got > 0;
+}
+
+bool KeyPhraseSorter::RunAfter(int a, int b) const {
+  const KeyPhrase& x = runs_[a].chunk[runs_[a].pos];
+  const KeyPhrase& y = runs_[b].chunk[runs_[b].pos];
+  return y.KeyLess(x) || (y.SameKey(x) && b < a);
+}
+
+bool KeyPhraseSorter::Finish() {
+  if (failed_) {
+    return false;
+  }
+  if (runs_.empty()) {
+    Sort();
+    num_pairs_ = buffer_.size();
+    buffer_pos_ = 0;
+    scratch_.clear();
+    scratch_.shrink_to_fit();
+    return true;
+  }
+  if (!buffer_.empty() && !Spill()) {
+    return false;
+  }
+  buffer_ = std::vector<KeyPhrase>();
+  scratch_ = std::vector<KeyPhrase>();
+  for (size_t r = 0; r < runs_.size(); ++r) {
+    rewind(runs_[r].fp);
+    if (Refill(&runs_[r])) {
+      heap_.push_back(r);
+    }
+  }
+  auto after = [this](int a, int b) -> bool { return RunAfter(a, b); };
+  std::make_heap(heap_.begin(), heap_.end(), after);
+  return !failed_;
+}
+
+bool KeyPhraseSorter::Next(KeyPhrase* pair) {
+  if (runs_.empty()) {
+    if (buffer_pos_ >= buffer_.size()) {
+      return false;
+    }
+    *pair = buffer_[buffer_pos_++];
+    return true;
+  }
+  if (heap_.empty() || failed_) {
+    return false;
+  }
+  auto after = [this](int a, int b) -> bool { return RunAfter(a, b); };
+  std::pop_heap(heap_.begin(), heap_.end(), after);
+  Run& run = runs_[heap_.back()];
+  *pair = run.chunk[run.pos++];
+  if (run.pos < run.chunk.size() || Refill(&run)) {
+    std::push_heap(heap_.begin(), heap_.end(), after);
+  } else {
+    heap_.pop_back();
+  }
+  return true;
+}
+
+}  // namespace lufz
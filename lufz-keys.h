@@ -0,0 +1,291 @@
+#ifndef LUFZ_KEYS_H_
+#define LUFZ_KEYS_H_
+
+/**
+ * Compact wildcard indexing keys, used by index-word-list. The index maps
+ * each key such as "AB??E" (a phrase key from LufzUtil::Key(), with some
+ * of its first WILDIZE_ALL_BEYOND letters replaced by "?") to the phrases
+ * that match it. Instead of building every such string for every phrase,
+ * keys are packed into a pair of integers, enumerated with bit operations,
+ * and counted in an open-addressing hash map. Only the keys that survive
+ * pruning are converted back into strings.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "lufz-util.h"
+
+namespace lufz {
+
+/**
+ * A packed key. lo holds the letter IDs (one byte each, with 0 for a
+ * wildcard) of the first 8 letters. hi holds the letter IDs of letters 8
+ * and 9 in its two low bytes, then the 16-bit wildcard mask, then the
+ * length (the number of letters in the key).
+ */
+struct WildKey {
+  uint64_t lo;
+  uint64_t hi;
+
+  bool operator==(const WildKey& other) const {
+    return lo == other.lo && hi == other.hi;
+  }
+  bool operator!=(const WildKey& other) const {
+    return !(*this == other);
+  }
+  int Length() const {
+    return hi >> 32;
+  }
+  int Mask() const {
+    return (hi >> 16) & 0xffff;
+  }
+  uint64_t Hash() const {
+    uint64_t h = (lo ^ (hi * 0x9e3779b97f4a7c15ULL)) * 0xff51afd7ed558ccdULL;
+    return h ^ (h >> 32);
+  }
+  /**
+   * Assigns the key to one of num_shards shards, using bits of Hash() that
+   * are independent of those that pick slots in a WildKeyMap.
+   */
+  int Shard(int num_shards) const {
+    return ((Hash() >> 32) * num_shards) >> 32;
+  }
+};
+
+static_assert(WILDIZE_ALL_BEYOND <= 10, "WildKey holds 10 wildizable letters");
+
+/**
+ * Converts keys to WildKeys and WildKeys to strings, assigning IDs to
+ * letters as they are seen.
+ */
+class WildKeyEncoder {
+ public:
+  WildKeyEncoder();
+
+  /**
+   * Sets *key to the WildKey (with no wildcards) for the key of a phrase,
+   * given as its parts (LufzUtil::PartsOf(LufzUtil::Key(normalized),
+   * false)). Returns false (after complaining) if there are too many
+   * distinct letters to fit in a byte.
+   */
+  bool Encode(const std::vector<std::string>& key_parts, WildKey* key);
+
+  /**
+   * The number of leading letters of key that can be replaced by wildcards.
+   */
+  static int NumWildizable(const WildKey& key) {
+    const int len = key.Length();
+    return len < WILDIZE_ALL_BEYOND ? len : WILDIZE_ALL_BEYOND;
+  }
+
+  /**
+   * Returns key (which must have no wildcards) with the letters in the
+   * positions set in mask replaced by wildcards.
+   */
+  static WildKey Wildize(const WildKey& key, int mask) {
+    WildKey variant;
+    variant.lo = key.lo & ~BYTE_MASKS[mask & 0xff];
+    variant.hi = (key.hi & ~BYTE_MASKS[(mask >> 8) & 0x3]) |
+                 (uint64_t(mask) << 16);
+    return variant;
+  }
+
+  /**
+   * Returns true if all the letters of key are wildcards.
+   */
+  static bool AllWild(const WildKey& key) {
+    return key.Mask() == (1 << NumWildizable(key)) - 1;
+  }
+
+  /**
+   * Returns the string form of key, such as "AB??E".
+   */
+  std::string ToString(const WildKey& key) const;
+
+ private:
+  /**
+   * BYTE_MASKS[m] has all the bits set in byte i for each bit i set in m.
+   */
+  static const uint64_t* const BYTE_MASKS;
+
+  std::unordered_map<std::string, int> letter_ids_;
+  std::vector<std::string> letters_;  // By ID.
+};
+
+/**
+ * An open-addressing (linear probing) hash map from WildKeys to positive
+ * int64_t values, growing as needed.
+ */
+class WildKeyMap {
+ public:
+  WildKeyMap();
+
+  /**
+   * Adds delta (which must be positive) to the value for key.
+   */
+  void Add(const WildKey& key, int64_t delta);
+
+  /**
+   * Returns the value for key, or 0 if not present.
+   */
+  int64_t Find(const WildKey& key) const;
+
+  size_t Size() const {
+    return size_;
+  }
+
+  /**
+   * Calls f(key, value) for each entry, in no particular order.
+   */
+  template <typename F>
+  void ForEach(F f) const {
+    for (const Slot& slot : slots_) {
+      if (slot.value > 0) {
+        f(slot.key, slot.value);
+      }
+    }
+  }
+
+ private:
+  struct Slot {
+    WildKey key;
+    int64_t value;  // 0 means empty.
+  };
+  void Grow();
+
+  std::vector<Slot> slots_;
+  size_t mask_;
+  size_t size_;
+};
+
+/**
+ * A (WildKey, phrase index) pair, in 16 bytes. The WildKey's hi word is
+ * squeezed into 32 bits, with the length moved into the top 6 bits.
+ */
+struct KeyPhrase {
+  uint64_t lo;
+  uint32_t hi;
+  int32_t phrase;
+
+  static KeyPhrase Make(const WildKey& key, int phrase) {
+    return {key.lo,
+            uint32_t(key.hi & 0x3ffffff) | (uint32_t(key.Length()) << 26),
+            phrase};
+  }
+  WildKey Key() const {
+    return {lo, (hi & 0x3ffffff) | (uint64_t(hi >> 26) << 32)};
+  }
+  bool SameKey(const KeyPhrase& other) const {
+    return lo == other.lo && hi == other.hi;
+  }
+  /**
+   * The order in which KeyPhraseSorter sorts keys.
+   */
+  bool KeyLess(const KeyPhrase& other) const {
+    return hi < other.hi || (hi == other.hi && lo < other.lo);
+  }
+};
+
+static_assert(sizeof(KeyPhrase) == 16, "KeyPhrase should be 16 bytes");
+static_assert(MAX_ENTRY_LENGTH < 64, "KeyPhrase holds lengths < 64");
+
+/**
+ * Sorts KeyPhrase pairs by key, stably (pairs with equal keys stay in the
+ * order in which they were added). Pairs are collected in a buffer of at
+ * most max_buffered pairs. A full buffer is radix-sorted (using
+ * num_threads threads) and spilled to a temporary file as a sorted run,
+ * and the runs are merged when the pairs are read back.
+ */
+class KeyPhraseSorter {
+ public:
+  KeyPhraseSorter(size_t max_buffered, int num_threads);
+  ~KeyPhraseSorter();
+
+  bool Add(const KeyPhrase& pair) {
+    buffer_.push_back(pair);
+    return buffer_.size() < max_buffered_ || Spill();
+  }
+
+  /**
+   * Call this after adding all the pairs, and then call Next() to read
+   * them back in sorted order.
+   */
+  bool Finish();
+
+  /**
+   * Sets *pair to the next pair. Returns false at the end (or on errors,
+   * see Failed()).
+   */
+  bool Next(KeyPhrase* pair);
+
+  bool Failed() const {
+    return failed_;
+  }
+  int64_t NumPairs() const {
+    return num_pairs_;
+  }
+  int NumSpilledRuns() const {
+    return runs_.size();
+  }
+
+ private:
+  struct Run {
+    FILE* fp;
+    std::vector<KeyPhrase> chunk;
+    size_t pos;
+  };
+
+  void Sort();
+  bool Spill();
+  bool Refill(Run* run);
+  /**
+   * Whether the current pair of run a comes after that of run b.
+   */
+  bool RunAfter(int a, int b) const;
+
+  size_t max_buffered_;
+  int num_threads_;
+  std::vector<KeyPhrase> buffer_;
+  std::vector<KeyPhrase> scratch_;  // For radix sorting.
+  size_t buffer_pos_;
+  std::vector<Run> runs_;
+  /**
+   * A min-heap of run indices, by their current pair (ties broken by the
+   * run index, as earlier runs have earlier pairs).
+   */
+  std::vector<int> heap_;
+  int64_t num_pairs_;
+  bool failed_;
+};
+
+/**
+ * The index, as posting lists in compressed sparse row form: the lexicon
+ * indices for keys[k] are ids[offsets[k]], ..., ids[offsets[k + 1] - 1].
+ */
+struct PostingLists {
+  std::vector<std::string> keys;
+  std::vector<int64_t> offsets;
+  std::vector<int32_t> ids;
+
+  size_t NumKeys() const {
+    return keys.size();
+  }
+  int64_t Size(size_t k) const {
+    return offsets[k + 1] - offsets[k];
+  }
+  const int32_t* Begin(size_t k) const {
+    return ids.data() + offsets[k];
+  }
+  const int32_t* End(size_t k) const {
+    return ids.data() + offsets[k + 1];
+  }
+};
+
+}  // namespace lufz
+
+#endif  // LUFZ_KEYS_H_
@@ -0,0 +1,209 @@
+/*
+MIT License
+
+Copyright (c) 2026 Viresh Ratnakar
+
+See the full license notice in https://github.com/viresh-ratnakar/lufz/blob/master/LICENSE
+*/
+
+/**
+ * Reference loader for the binary lexicon bundles written by
+ * "index-word-list ... --bundle=<file>" (see lufz-bundle.h for the layout).
+ * Nothing is parsed other than a small JSON header: the arrays are typed
+ * array views over the loaded ArrayBuffer, and strings are only decoded
+ * when asked for. Typed arrays use the byte order of the platform, which
+ * is little-endian (like the bundle) on all current browsers.
+ *
+ * Usage:
+ *   const response = await fetch('lufz-en-lexicon.bundle');
+ *   const lexicon = new LufzLexiconBundle(await response.arrayBuffer());
+ *   lexicon.form(42);           // The lexicon entry at index 42.
+ *   lexicon.index('A??');       // Int32Array of lexicon indices, or null.
+ *   lexicon.anagramShard(17);   // Int32Array of lexicon indices.
+ *   lexicon.phones(42);         // [['B', 'AH', ...], ...]
+ *   lexicon.phindexShard(17);
+ *   // Only in bundles written with --extra_sections (else these give null):
+ *   lexicon.longIndex('???A???????????');  // Long entries, by position.
+ *   lexicon.suffixIndex('?????????NESS');  // Long entries, by suffix.
+ *   lexicon.agmIndex('ABNN');   // Exact anagram index lookup.
+ *   lexicon.phoneIndex('B AH N AE N AH');
+ */
+
+const LUFZ_BUNDLE_MAGIC = 'LUFZBNDL';
+const LUFZ_BUNDLE_FORMAT_VERSION = 1;
+
+/**
+ * Strings stored as a Uint8Array of concatenated UTF-8 bytes, delimited
+ * by a Uint32Array of offsets.
+ */
+class LufzStringTable {
+  constructor(bytes, offsets) {
+    this.bytes = bytes;
+    this.offsets = offsets;
+    this.decoder = new TextDecoder();
+    this.encoder = new TextEncoder();
+  }
+
+  get length() {
+    return this.offsets.length - 1;
+  }
+
+  get(i) {
+    return this.decoder.decode(
+        this.bytes.subarray(this.offsets[i], this.offsets[i + 1]));
+  }
+
+  /**
+   * Returns the position of key, or -1 if absent. The table must be sorted
+   * (by bytes), as the keys of all the indices are.
+   */
+  find(key) {
+    const k = this.encoder.encode(key);
+    let lo = 0;
+    let hi = this.length;
+    while (lo < hi) {
+      const mid = (lo + hi) >> 1;
+      const cmp = this.compare(mid, k);
+      if (cmp == 0) return mid;
+      if (cmp < 0) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    return -1;
+  }
+
+  compare(i, k) {
+    const start = this.offsets[i];
+    const len = this.offsets[i + 1] - start;
+    const n = Math.min(len, k.length);
+    for (let j = 0; j < n; j++) {
+      const diff = this.bytes[start + j] - k[j];
+      if (diff != 0) return diff;
+    }
+    return len - k.length;
+  }
+}
+
+class LufzLexiconBundle {
+  constructor(buffer) {
+    const view = new DataView(buffer);
+    let magic = '';
+    for (let i = 0; i < LUFZ_BUNDLE_MAGIC.length; i++) {
+      magic += String.fromCharCode(view.getUint8(i));
+    }
+    if (magic != LUFZ_BUNDLE_MAGIC) {
+      throw new Error('Not a Lufz lexicon bundle');
+    }
+    const version = view.getUint32(8, true);
+    if (version != LUFZ_BUNDLE_FORMAT_VERSION) {
+      throw new Error('Unsupported Lufz bundle format version: ' + version);
+    }
+    const headerLength = view.getUint32(12, true);
+    const header = JSON.parse(new TextDecoder().decode(
+        new Uint8Array(buffer, 16, headerLength)));
+    this.id = header.id;
+    this.language = header.language;
+    this.script = header.script;
+    this.letters = header.letters;
+    this.phonemes = header.phonemes;
+
+    const types = {
+      'Uint8': Uint8Array,
+      'Uint16': Uint16Array,
+      'Int32': Int32Array,
+      'Uint32': Uint32Array,
+    };
+    this.arrays = {};
+    for (const name in header.arrays) {
+      const a = header.arrays[name];
+      this.arrays[name] = new types[a.type](buffer, a.offset, a.length);
+    }
+    this.lexicon = this.stringTable('lexicon');
+    this.indexKeys = this.stringTable('index.keys');
+    this.longIndexKeys = this.stringTable('longindex.keys');
+    this.suffixIndexKeys = this.stringTable('suffixindex.keys');
+    this.agmIndexKeys = this.stringTable('agmindex.keys');
+    this.phoneIndexKeys = this.stringTable('phoneindex.keys');
+  }
+
+  /**
+   * Returns null if the bundle does not have the string table (the indices
+   * other than index are only written with --extra_sections).
+   */
+  stringTable(name) {
+    if (!this.arrays[name + '.bytes']) return null;
+    return new LufzStringTable(this.arrays[name + '.bytes'],
+                               this.arrays[name + '.offsets']);
+  }
+
+  /**
+   * The number of lexicon entries (including the empty one at index 0).
+   */
+  get size() {
+    return this.lexicon.length;
+  }
+
+  form(i) {
+    return this.lexicon.get(i);
+  }
+
+  postings(name, k) {
+    const offsets = this.arrays[name + '.offsets'];
+    return this.arrays[name + '.ids'].subarray(offsets[k], offsets[k + 1]);
+  }
+
+  lookup(name, keys, key) {
+    if (!keys) return null;
+    const k = keys.find(key);
+    return k < 0 ? null : this.postings(name, k);
+  }
+
+  index(key) {
+    return this.lookup('index', this.indexKeys, key);
+  }
+
+  longIndex(key) {
+    return this.lookup('longindex', this.longIndexKeys, key);
+  }
+
+  suffixIndex(key) {
+    return this.lookup('suffixindex', this.suffixIndexKeys, key);
+  }
+
+  agmIndex(key) {
+    return this.lookup('agmindex', this.agmIndexKeys, key);
+  }
+
+  phoneIndex(key) {
+    return this.lookup('phoneindex', this.phoneIndexKeys, key);
+  }
+
+  anagramShard(shard) {
+    return this.postings('anagrams', shard);
+  }
+
+  phindexShard(shard) {
+    return this.postings('phindex', shard);
+  }
+
+  phones(i) {
+    const offsets = this.arrays['phones.offsets'];
+    const pronOffsets = this.arrays['phones.pronOffsets'];
+    const ids = this.arrays['phones.ids'];
+    const phones = [];
+    for (let p = offsets[i]; p < offsets[i + 1]; p++) {
+      const phone = [];
+      for (let j = pronOffsets[p]; j < pronOffsets[p + 1]; j++) {
+        phone.push(this.phonemes[ids[j]]);
+      }
+      phones.push(phone);
+    }
+    return phones;
+  }
+}
+
+if (typeof module !== 'undefined' && module.exports) {
+  module.exports = {LufzLexiconBundle, LufzStringTable};
+}
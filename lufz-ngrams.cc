@@ -0,0 +1,370 @@
+#include <stdint.h>
+#include <stdio.h>
+
+#include <math.h>
+
+#include <algorithm>
+#include <functional>
+#include <queue>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "lufz-ngrams.h"
+
+namespace lufz {
+
+namespace {
+const int SKETCH_DEPTH = 4;
+const uint64_t SKETCH_WIDTH = 1 << 21;
+
+/**
+ * A sorted run of (hash, count) pairs, being read back for merging.
+ */
+struct RunReader {
+  FILE* fp;
+  uint64_t hash;
+  int64_t count;
+  bool Next() {
+    return fread(&hash, sizeof(hash), 1, fp) == 1 &&
+           fread(&count, sizeof(count), 1, fp) == 1;
+  }
+};
+}  // namespace
+
+NgramDiscoverer::NgramDiscoverer(const std::string& spill_prefix,
+                                 size_t max_candidates,
+                                 size_t max_buffered)
+    : spill_prefix_(spill_prefix),
+      max_candidates_(max_candidates),
+      max_buffered_(max_buffered),
+      sketch_(SKETCH_DEPTH * SKETCH_WIDTH, 0),
+      num_runs_created_(0) {}
+
+NgramDiscoverer::~NgramDiscoverer() {
+  RemoveRuns();
+}
+
+void NgramDiscoverer::RemoveRuns() {
+  for (const std::string& run : runs_) {
+    remove(run.c_str());
+  }
+  runs_.clear();
+}
+
+uint64_t NgramDiscoverer::Hash(const std::string& s) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (unsigned char c : s) {
+    hash ^= c;
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+uint64_t NgramDiscoverer::SketchAdd(uint64_t hash, int64_t count) {
+  // Row hashes derived from two halves of hash (Kirsch-Mitzenmacher).
+  const uint64_t h1 = hash;
+  const uint64_t h2 = (hash >> 32) | (hash << 32) | 1;
+  uint64_t estimate = UINT32_MAX;
+  for (int row = 0; row < SKETCH_DEPTH; ++row) {
+    uint32_t& cell =
+        sketch_[row * SKETCH_WIDTH + ((h1 + row * h2) & (SKETCH_WIDTH - 1))];
+    const uint64_t sum = uint64_t(cell) + count;
+    cell = sum > UINT32_MAX ? UINT32_MAX : sum;
+    estimate = std::min(estimate, uint64_t(cell));
+  }
+  return estimate;
+}
+
+bool NgramDiscoverer::Add(const std::string& ngram, int64_t count) {
+  const uint64_t hash = Hash(ngram);
+  buffer_[hash] += count;
+  const uint64_t estimate = SketchAdd(hash, count);
+  auto it = candidates_.find(ngram);
+  if (it != candidates_.end()) {
+    candidates_by_estimate_.erase({it->second.estimate, ngram});
+    it->second.estimate = estimate;
+    candidates_by_estimate_.insert({estimate, ngram});
+  } else if (candidates_.size() < max_candidates_ ||
+             candidates_by_estimate_.begin()->first < estimate) {
+    if (candidates_.size() >= max_candidates_) {
+      auto lowest = candidates_by_estimate_.begin();
+      candidates_.erase(lowest->second);
+      candidates_by_estimate_.erase(lowest);
+    }
+    candidates_[ngram] = {hash, estimate};
+    candidates_by_estimate_.insert({estimate, ngram});
+  }
+  if (buffer_.size() >= max_buffered_) {
+    return Spill();
+  }
+  return true;
+}
+
+std::string NgramDiscoverer::NewRun() {
+  runs_.push_back(spill_prefix_ + ".run" + std::to_string(num_runs_created_++));
+  return runs_.back();
+}
+
+bool NgramDiscoverer::Spill() {
+  std::unordered_set<uint64_t> candidate_hashes;
+  for (const auto& [ngram, candidate] : candidates_) {
+    candidate_hashes.insert(candidate.hash);
+  }
+  std::vector<std::pair<uint64_t, int64_t>> sorted;
+  for (const auto& [hash, count] : buffer_) {
+    if (candidate_hashes.count(hash) > 0) {
+      sorted.push_back({hash, count});
+    }
+  }
+  sort(sorted.begin(), sorted.end());
+  const std::string run = NewRun();
+  FILE* fp = fopen(run.c_str(), "wb");
+  bool ok = fp != nullptr;
+  for (const auto& [hash, count] : sorted) {
+    ok = ok && fwrite(&hash, sizeof(hash), 1, fp) == 1 &&
+         fwrite(&count, sizeof(count), 1, fp) == 1;
+  }
+  if (fp && fclose(fp) != 0) {
+    ok = false;
+  }
+  if (!ok) {
+    fprintf(stderr, "Error writing %s\n", run.c_str());
+    remove(run.c_str());
+    runs_.pop_back();
+    return false;
+  }
+  buffer_.clear();
+  return true;
+}
+
+bool NgramDiscoverer::MergeRuns(
+    const std::vector<std::string>& runs,
+    const std::function<bool(uint64_t, int64_t)>& emit) {
+  std::vector<RunReader> readers;
+  bool ok = true;
+  for (const std::string& run : runs) {
+    FILE* fp = fopen(run.c_str(), "rb");
+    if (!fp) {
+      fprintf(stderr, "Could not open %s\n", run.c_str());
+      ok = false;
+      break;
+    }
+    readers.push_back({fp, 0, 0});
+  }
+  typedef std::pair<uint64_t, int> HeapEntry;  // (hash, reader)
+  std::priority_queue<HeapEntry, std::vector<HeapEntry>,
+                      std::greater<HeapEntry>> heap;
+  for (size_t r = 0; ok && r < readers.size(); ++r) {
+    if (readers[r].Next()) {
+      heap.push({readers[r].hash, int(r)});
+    }
+  }
+  while (ok && !heap.empty()) {
+    const uint64_t hash = heap.top().first;
+    int64_t total = 0;
+    while (!heap.empty() && heap.top().first == hash) {
+      const int r = heap.top().second;
+      RunReader& reader = readers[r];
+      heap.pop();
+      total += reader.count;
+      if (reader.Next()) {
+        heap.push({reader.hash, r});
+      }
+    }
+    ok = emit(hash, total);
+  }
+  for (RunReader& reader : readers) {
+    fclose(reader.fp);
+  }
+  return ok;
+}
+
+bool NgramDiscoverer::Finish(
+    int64_t min_count, size_t max_results,
+    std::vector<std::pair<std::string, int64_t>>* top) {
+  top->clear();
+  if (!buffer_.empty() && !Spill()) {
+    RemoveRuns();
+    return false;
+  }
+  // Merge MAX_MERGE_FAN_IN runs at a time into a new run, until few enough
+  // are left to be merged (and opened) at once.
+  while (runs_.size() > MAX_MERGE_FAN_IN) {
+    const std::vector<std::string> inputs(runs_.begin(),
+                                          runs_.begin() + MAX_MERGE_FAN_IN);
+    const std::string run = NewRun();
+    FILE* fp = fopen(run.c_str(), "wb");
+    bool ok = fp != nullptr &&
+        MergeRuns(inputs, [fp](uint64_t hash, int64_t count) {
+          return fwrite(&hash, sizeof(hash), 1, fp) == 1 &&
+                 fwrite(&count, sizeof(count), 1, fp) == 1;
+        });
+    if (fp && fclose(fp) != 0) {
+      ok = false;
+    }
+    if (!ok) {
+      fprintf(stderr, "Error merging runs into %s\n", run.c_str());
+      RemoveRuns();
+      return false;
+    }
+    for (const std::string& input : inputs) {
+      remove(input.c_str());
+    }
+    runs_.erase(runs_.begin(), runs_.begin() + MAX_MERGE_FAN_IN);
+  }
+
+  std::unordered_map<uint64_t, const std::string*> candidate_hashes;
+  for (const auto& [ngram, candidate] : candidates_) {
+    candidate_hashes[candidate.hash] = &ngram;
+  }
+  const bool ok = MergeRuns(runs_, [&](uint64_t hash, int64_t total) {
+    if (total >= min_count) {
+      auto it = candidate_hashes.find(hash);
+      if (it != candidate_hashes.end()) {
+        top->push_back({*it->second, total});
+      }
+    }
+    return true;
+  });
+  RemoveRuns();
+  if (!ok) {
+    top->clear();
+    return false;
+  }
+
+  sort(top->begin(), top->end(),
+       [](const std::pair<std::string, int64_t>& a,
+          const std::pair<std::string, int64_t>& b) -> bool {
+         if (a.second == b.second) {
+           return a.first < b.first;
+         }
+         return a.second > b.second;
+       });
+  if (top->size() > max_results) {
+    top->resize(max_results);
+  }
+  return true;
+}
+
+CooccurrenceCounter::CooccurrenceCounter(size_t max_pairs)
+    : max_pairs_(max_pairs), shards_(NUM_SHARDS) {}
+
+int CooccurrenceCounter::Shard(uint64_t pair) {
+  // Mix the bits (the MurmurHash3 finalizer), as nearby pairs are common.
+  pair ^= pair >> 33;
+  pair *= 0xff51afd7ed558ccdULL;
+  pair ^= pair >> 33;
+  return pair % NUM_SHARDS;
+}
+
+int CooccurrenceCounter::ShardGroup(uint64_t pair, int num_groups) {
+  return Shard(pair) % num_groups;
+}
+
+void CooccurrenceCounter::Add(
+    const std::vector<const std::vector<std::vector<uint64_t>>*>& buffers) {
+  const int num_threads = buffers.empty() ? 0 : buffers[0]->size();
+  auto add_shards = [this, &buffers](int t) {
+    for (const std::vector<std::vector<uint64_t>>* buffer : buffers) {
+      for (uint64_t pair : (*buffer)[t]) {
+        shards_[Shard(pair)][pair]++;
+      }
+    }
+  };
+  std::vector<std::thread> threads;
+  for (int t = 1; t < num_threads; ++t) {
+    threads.push_back(std::thread(add_shards, t));
+  }
+  if (num_threads > 0) {
+    add_shards(0);
+  }
+  for (std::thread& t : threads) {
+    t.join();
+  }
+  if (NumPairs() > max_pairs_) {
+    Prune();
+  }
+}
+
+size_t CooccurrenceCounter::NumPairs() const {
+  size_t num_pairs = 0;
+  for (const auto& shard : shards_) {
+    num_pairs += shard.size();
+  }
+  return num_pairs;
+}
+
+void CooccurrenceCounter::Prune() {
+  // The cutoff is picked afresh from the current counts each time (and not
+  // carried over from earlier prunes), so that the pairs seen least so far
+  // are the ones that go.
+  std::vector<uint32_t> counts;
+  counts.reserve(NumPairs());
+  for (const auto& shard : shards_) {
+    for (const auto& [pair, count] : shard) {
+      counts.push_back(count);
+    }
+  }
+  const size_t keep = std::min(max_pairs_ / 2, counts.size() - 1);
+  std::nth_element(counts.begin(), counts.begin() + keep, counts.end(),
+                   std::greater<uint32_t>());
+  uint32_t cutoff = counts[keep];
+  const size_t num_at_least_cutoff =
+      std::count_if(counts.begin(), counts.end(),
+                    [cutoff](uint32_t count) { return count >= cutoff; });
+  if (num_at_least_cutoff > max_pairs_) {
+    ++cutoff;
+  }
+  counts.clear();
+  for (auto& shard : shards_) {
+    for (auto it = shard.begin(); it != shard.end();) {
+      if (it->second < cutoff) {
+        it = shard.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+  fprintf(stderr, "Pruned co-occurrences with counts < %u, %zu left\n",
+          cutoff, NumPairs());
+}
+
+void CooccurrenceCounter::TopAssociates(
+    const std::vector<int64_t>& pair_counts,
+    int64_t num_pairs,
+    int64_t min_count,
+    int top_k,
+    std::vector<std::vector<Associate>>* associates) const {
+  associates->assign(pair_counts.size(), {});
+  for (const auto& shard : shards_) {
+    for (const auto& [pair, count] : shard) {
+      if (count < min_count) continue;
+      const int a = pair >> 32;
+      const int b = pair & 0xffffffff;
+      if (pair_counts[a] == 0 || pair_counts[b] == 0) continue;
+      // P(a, b) = count / num_pairs and P(a) = pair_counts[a] / (2 *
+      // num_pairs), as each co-occurrence has two phrases.
+      const double pmi = log(double(count) * 4 * num_pairs /
+                             (double(pair_counts[a]) * pair_counts[b]));
+      (*associates)[a].push_back({b, count, pmi});
+      (*associates)[b].push_back({a, count, pmi});
+    }
+  }
+  for (auto& v : *associates) {
+    sort(v.begin(), v.end(), [](const Associate& x, const Associate& y) {
+      if (x.pmi == y.pmi) {
+        return x.index < y.index;
+      }
+      return x.pmi > y.pmi;
+    });
+    if (int(v.size()) > top_k) {
+      v.resize(top_k);
+    }
+  }
+}
+
+}  // namespace lufz
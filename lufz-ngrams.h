@@ -0,0 +1,186 @@
+#ifndef LUFZ_NGRAMS_H_
+#define LUFZ_NGRAMS_H_
+
+/**
+ * N-gram statistics gathered over a corpus in bounded memory, used by
+ * add-wiki-popularity: finding the most frequent n-grams (to discover
+ * phrases that are missing from the lexicon), and counting co-occurrences
+ * of lexicon phrases (to find related phrases).
+ */
+
+#include <stdint.h>
+
+#include <functional>
+#include <map>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace lufz {
+
+class NgramDiscoverer {
+ public:
+  /**
+   * Temporary files (sorted runs of counts) are created with names that
+   * start with spill_prefix. At most max_candidates n-grams have their
+   * text retained (as "heavy hitter" candidates) and at most max_buffered
+   * distinct n-gram counts are held in memory before being spilled. Only
+   * the counts of the candidates of the time get spilled, so an n-gram
+   * that only becomes a candidate later misses the counts of the runs
+   * before that (its count is then a lower bound).
+   */
+  NgramDiscoverer(const std::string& spill_prefix,
+                  size_t max_candidates,
+                  size_t max_buffered);
+  ~NgramDiscoverer();
+
+  /**
+   * Records count occurrences of ngram. Returns false (after complaining)
+   * if the counts could not be spilled, in which case they are kept in
+   * memory.
+   */
+  bool Add(const std::string& ngram, int64_t count);
+
+  /**
+   * Merges the spilled runs (at most MAX_MERGE_FAN_IN at a time, in as
+   * many passes as needed) to get the counts of the candidates and returns
+   * (in *top) those with counts >= min_count, sorted by decreasing count,
+   * at most max_results of them. Deletes the temporary files, even on
+   * failure.
+   */
+  bool Finish(int64_t min_count, size_t max_results,
+              std::vector<std::pair<std::string, int64_t>>* top);
+
+  int64_t NumSpilledRuns() const {
+    return runs_.size();
+  }
+
+  static const int MAX_MERGE_FAN_IN = 32;
+
+ private:
+  static uint64_t Hash(const std::string& s);
+
+  /**
+   * Count-min sketch: adds count for hash and returns the new estimate.
+   */
+  uint64_t SketchAdd(uint64_t hash, int64_t count);
+
+  /**
+   * Writes the counts of the candidates in buffer_ as a sorted run, and
+   * clears buffer_ if that succeeds.
+   */
+  bool Spill();
+
+  /**
+   * Returns the name for a new run, and adds it to runs_.
+   */
+  std::string NewRun();
+
+  /**
+   * Merges runs, calling emit(hash, total count) for each distinct hash,
+   * in increasing order of hashes.
+   */
+  bool MergeRuns(const std::vector<std::string>& runs,
+                 const std::function<bool(uint64_t, int64_t)>& emit);
+
+  void RemoveRuns();
+
+  std::string spill_prefix_;
+  size_t max_candidates_;
+  size_t max_buffered_;
+
+  std::vector<uint32_t> sketch_;
+
+  /**
+   * Heavy-hitter candidates: text and the estimate at which they are
+   * filed in candidates_by_estimate_ (the lowest one gets evicted).
+   */
+  struct Candidate {
+    uint64_t hash;
+    uint64_t estimate;
+  };
+  std::unordered_map<std::string, Candidate> candidates_;
+  std::set<std::pair<uint64_t, std::string>> candidates_by_estimate_;
+
+  /**
+   * Exact counts (by hash) not yet spilled to disk.
+   */
+  std::unordered_map<uint64_t, int64_t> buffer_;
+  std::vector<std::string> runs_;
+  int64_t num_runs_created_;
+};
+
+/**
+ * Counts of co-occurrences of pairs of lexicon phrases (identified by their
+ * indices). The counts live in NUM_SHARDS hash maps keyed by the packed
+ * pair, so that buffers of pairs collected by different threads can be
+ * added in parallel, with each thread owning some of the shards. To bound
+ * memory, whenever there are more than max_pairs pairs, all but the (about)
+ * max_pairs / 2 most frequent ones are pruned away.
+ */
+class CooccurrenceCounter {
+ public:
+  explicit CooccurrenceCounter(size_t max_pairs);
+
+  /**
+   * Packs a pair of phrase indices into a key (the order does not matter).
+   */
+  static uint64_t Pair(int a, int b) {
+    if (a > b) std::swap(a, b);
+    return (uint64_t(a) << 32) | uint32_t(b);
+  }
+
+  /**
+   * Returns which of num_groups groups of shards the shard of pair is in.
+   */
+  static int ShardGroup(uint64_t pair, int num_groups);
+
+  /**
+   * Adds one to the count of each pair in each of the buffers. Each buffer
+   * has its pairs split up by ShardGroup(pair, num_threads), where
+   * num_threads is the number of groups, and a thread per group adds the
+   * pairs of that group (so that it only reads the pairs of its shards).
+   */
+  void Add(const std::vector<const std::vector<std::vector<uint64_t>>*>&
+               buffers);
+
+  size_t NumPairs() const;
+
+  struct Associate {
+    int index;
+    int64_t count;
+    double pmi;
+  };
+
+  /**
+   * Sets (*associates)[i] to the (at most) top_k phrases with the highest
+   * pointwise mutual information with phrase i, among those that co-occur
+   * with it at least min_count times. pair_counts[i] is the number of
+   * co-occurrences (out of num_pairs, all counted before any pruning) that
+   * phrase i is part of, so the marginals are on the same windowed basis as
+   * the pair counts.
+   */
+  void TopAssociates(const std::vector<int64_t>& pair_counts,
+                     int64_t num_pairs,
+                     int64_t min_count,
+                     int top_k,
+                     std::vector<std::vector<Associate>>* associates) const;
+
+ private:
+  static const int NUM_SHARDS = 64;
+  static int Shard(uint64_t pair);
+  /**
+   * Prunes away the pairs with counts below the count at rank
+   * max_pairs_ / 2 (and the ones at it too, if there are too many ties).
+   */
+  void Prune();
+
+  size_t max_pairs_;
+  std::vector<std::unordered_map<uint64_t, uint32_t>> shards_;
+};
+
+}  // namespace lufz
+
+#endif  // LUFZ_NGRAMS_H_
@@ -0,0 +1,246 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <string_view>
+
+#include "lufz-reader.h"
+
+namespace lufz {
+
+LineReader::LineReader()
+    : fd_(-1),
+      owns_fd_(false),
+      offset_(0),
+      failed_(false),
+      map_(nullptr),
+      map_size_(0),
+      current_(0),
+      pos_(0),
+      started_(false),
+      stop_(false) {}
+
+LineReader::~LineReader() {
+  Close();
+}
+
+bool LineReader::Open(const std::string& file) {
+  Close();
+  file_ = file == "-" ? "stdin" : file;
+  if (file == "-") {
+    fd_ = 0;
+    owns_fd_ = false;
+  } else {
+    fd_ = open(file.c_str(), O_RDONLY);
+    if (fd_ < 0) {
+      fprintf(stderr, "Could not open %s\n", file.c_str());
+      return false;
+    }
+    owns_fd_ = true;
+  }
+  struct stat st;
+  if (fstat(fd_, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    void* map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd_, 0);
+    if (map != MAP_FAILED) {
+      map_ = static_cast<const char*>(map);
+      map_size_ = st.st_size;
+      madvise(map, map_size_, MADV_SEQUENTIAL);
+    }
+  }
+  return true;
+}
+
+void LineReader::Close() {
+  if (io_thread_.joinable()) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    cond_.notify_all();
+    io_thread_.join();
+  }
+  if (map_) {
+    munmap(const_cast<char*>(map_), map_size_);
+  }
+  if (owns_fd_ && fd_ >= 0) {
+    close(fd_);
+  }
+  fd_ = -1;
+  owns_fd_ = false;
+  offset_ = 0;
+  failed_ = false;
+  map_ = nullptr;
+  map_size_ = 0;
+  current_ = 0;
+  pos_ = 0;
+  started_ = false;
+  stop_ = false;
+  carry_.clear();
+}
+
+bool LineReader::SkipTo(int64_t offset) {
+  if (map_) {
+    offset_ = offset < map_size_ ? offset : map_size_;
+    return offset_ == offset;
+  }
+  if (started_) {
+    return false;
+  }
+  if (lseek(fd_, offset, SEEK_SET) == offset) {
+    offset_ = offset;
+    return true;
+  }
+  std::vector<char> buf(BLOCK_SIZE);
+  while (offset_ < offset) {
+    const size_t want = std::min<int64_t>(offset - offset_, buf.size());
+    ssize_t got = read(fd_, buf.data(), want);
+    if (got < 0 && errno == EINTR) {
+      continue;
+    }
+    if (got < 0) {
+      fprintf(stderr, "Error reading %s: %s\n", file_.c_str(),
+              strerror(errno));
+      failed_ = true;
+    }
+    if (got <= 0) {
+      return false;
+    }
+    offset_ += got;
+  }
+  return true;
+}
+
+void LineReader::ReadBlocks() {
+  for (int b = 0; ; b = 1 - b) {
+    Block& block = blocks_[b];
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cond_.wait(lock, [this, &block] { return stop_ || !block.filled; });
+      if (stop_) return;
+    }
+    size_t size = 0;
+    bool eof = false;
+    int error = 0;
+    while (size < BLOCK_SIZE) {
+      ssize_t got = read(fd_, block.data.data() + size, BLOCK_SIZE - size);
+      if (got < 0 && errno == EINTR) {
+        continue;
+      }
+      if (got <= 0) {
+        eof = true;
+        error = got < 0 ? errno : 0;
+        break;
+      }
+      size += got;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      block.size = size;
+      block.eof = eof;
+      block.error = error;
+      block.filled = true;
+    }
+    cond_.notify_all();
+    if (eof) return;
+  }
+}
+
+bool LineReader::NextBlock() {
+  if (!started_) {
+    for (Block& block : blocks_) {
+      block.data.resize(BLOCK_SIZE);
+      block.size = 0;
+      block.eof = false;
+      block.error = 0;
+      block.filled = false;
+    }
+    current_ = 0;
+    started_ = true;
+    io_thread_ = std::thread(&LineReader::ReadBlocks, this);
+  } else {
+    if (blocks_[current_].eof) {
+      return false;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      blocks_[current_].filled = false;
+    }
+    cond_.notify_all();
+    current_ = 1 - current_;
+  }
+  pos_ = 0;
+  Block& block = blocks_[current_];
+  std::unique_lock<std::mutex> lock(mutex_);
+  cond_.wait(lock, [&block] { return block.filled; });
+  if (block.error && !failed_) {
+    fprintf(stderr, "Error reading %s: %s\n", file_.c_str(),
+            strerror(block.error));
+    failed_ = true;
+  }
+  return block.size > 0 || !block.eof;
+}
+
+bool LineReader::Next(std::string_view* line) {
+  if (map_) {
+    if (offset_ >= map_size_) {
+      return false;
+    }
+    const char* start = map_ + offset_;
+    const char* nl = static_cast<const char*>(
+        memchr(start, '\n', map_size_ - offset_));
+    const size_t len = nl ? (nl - start) + 1 : map_size_ - offset_;
+    *line = std::string_view(start, len);
+    offset_ += len;
+    return true;
+  }
+  if (fd_ < 0) {
+    return false;
+  }
+  carry_.clear();
+  bool carrying = false;
+  for (;;) {
+    if (!started_ || pos_ >= blocks_[current_].size) {
+      if (!NextBlock()) {
+        break;
+      }
+      continue;
+    }
+    const Block& block = blocks_[current_];
+    const char* start = block.data.data() + pos_;
+    const char* nl = static_cast<const char*>(
+        memchr(start, '\n', block.size - pos_));
+    if (!nl) {
+      // The line continues in the next block.
+      carry_.append(start, block.size - pos_);
+      carrying = true;
+      pos_ = block.size;
+      continue;
+    }
+    const size_t len = (nl - start) + 1;
+    pos_ += len;
+    if (carrying) {
+      carry_.append(start, len);
+      *line = carry_;
+      offset_ += carry_.size();
+    } else {
+      *line = std::string_view(start, len);
+      offset_ += len;
+    }
+    return true;
+  }
+  if (carrying && !carry_.empty()) {
+    *line = carry_;
+    offset_ += carry_.size();
+    return true;
+  }
+  return false;
+}
+
+}  // namespace lufz
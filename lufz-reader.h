@@ -0,0 +1,105 @@
+#ifndef LUFZ_READER_H_
+#define LUFZ_READER_H_
+
+#include <stdint.h>
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+namespace lufz {
+
+/**
+ * Reads a file line by line, without any limit on line lengths. Regular
+ * files are mmapped. Anything else (such as a pipe on stdin) is read in
+ * large blocks on a dedicated I/O thread, with double buffering, so that
+ * reading the next block overlaps with processing the current one.
+ */
+class LineReader {
+ public:
+  static const size_t BLOCK_SIZE = 4 << 20;
+
+  LineReader();
+  ~LineReader();
+
+  /**
+   * Pass "-" as the file name for stdin.
+   */
+  bool Open(const std::string& file);
+  void Close();
+
+  /**
+   * Skips to the given byte offset (from the start of the file). Must be
+   * called before the first call to Next(). Seeks if possible, otherwise
+   * reads and discards the bytes.
+   */
+  bool SkipTo(int64_t offset);
+
+  /**
+   * Sets *line to the next line, including its trailing newline (if any).
+   * *line stays valid until the next call. Returns false at the end, or on
+   * a read error (see Failed()).
+   */
+  bool Next(std::string_view* line);
+
+  /**
+   * True if reading failed (other than being interrupted by a signal, which
+   * is retried), so that Next() returning false was not the real end of the
+   * input. The error has been reported on stderr.
+   */
+  bool Failed() const {
+    return failed_;
+  }
+
+  /**
+   * The byte offset (from the start of the file) just past the last line
+   * returned by Next().
+   */
+  int64_t Offset() const {
+    return offset_;
+  }
+
+ private:
+  struct Block {
+    std::vector<char> data;
+    size_t size;
+    bool eof;
+    int error;  // The errno of a failed read, which ends the data.
+    bool filled;
+  };
+
+  void ReadBlocks();
+  /**
+   * Moves on to the next block, once the I/O thread has filled it. Returns
+   * false if there is no more data.
+   */
+  bool NextBlock();
+
+  std::string file_;
+  int fd_;
+  bool owns_fd_;
+  int64_t offset_;
+  bool failed_;
+
+  // For mmapped files.
+  const char* map_;
+  int64_t map_size_;
+
+  // For reading blocks.
+  Block blocks_[2];
+  int current_;
+  size_t pos_;
+  bool started_;
+  bool stop_;
+  std::thread io_thread_;
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  std::string carry_;
+};
+
+}  // namespace lufz
+
+#endif  // LUFZ_READER_H_
@@ -1,18 +1,32 @@
 #include <algorithm>
 #include <map>
+#include <set>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <ctype.h>
 #include <math.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <unistd.h>
+#include <zlib.h>
 
+#include "lufz-bundle.h"
+#include "lufz-counts.h"
+#include "lufz-cuckoo.h"
+#include "lufz-gzip.h"
+#include "lufz-keys.h"
+#include "lufz-ngrams.h"
+#include "lufz-reader.h"
 #include "lufz-utf8.h"
 #include "lufz-util.h"
+#include "lufz-writer.h"
 
 using namespace std;
 using namespace lufz;
@@ -94,9 +108,954 @@ void PrintCharInfo(const std::string& chr) {
   printf("  upper: %s,\n", info.upper.c_str());
   printf("}\n");
 }
+
+/**
+ * Self-tests, run with "lufz-util-test selftest". Each failed check is
+ * printed, and counted in num_failures.
+ */
+int num_failures = 0;
+
+void Expect(bool ok, const char* what, int line) {
+  if (!ok) {
+    printf("FAILED at line %d: %s\n", line, what);
+    ++num_failures;
+  }
+}
+#define EXPECT(cond) Expect((cond), #cond, __LINE__)
+
+/**
+ * A temporary file name for a test, unique to this process.
+ */
+std::string TestFile(const std::string& name) {
+  return "/tmp/lufz-util-test-" + std::to_string(getpid()) + "-" + name;
+}
+
+void TestWildKeys(LufzUtil* util) {
+  WildKeyEncoder encoder;
+  WildKey key;
+  EXPECT(encoder.Encode(util->PartsOf(util->Key("ABATE"), false), &key));
+  EXPECT(encoder.ToString(key) == "ABATE");
+  EXPECT(key.Length() == 5 && key.Mask() == 0);
+  EXPECT(WildKeyEncoder::NumWildizable(key) == 5);
+  EXPECT(WildKeyEncoder::Wildize(key, 0) == key);
+  const WildKey variant = WildKeyEncoder::Wildize(key, 0x5);
+  EXPECT(encoder.ToString(variant) == "?B?TE");
+  EXPECT(variant.Mask() == 0x5 && variant.Length() == 5);
+  EXPECT(!WildKeyEncoder::AllWild(variant));
+  EXPECT(WildKeyEncoder::AllWild(WildKeyEncoder::Wildize(key, 0x1f)));
+  EXPECT(encoder.ToString(WildKeyEncoder::Wildize(key, 0x1f)) == "?????");
+
+  // Every pattern gives a distinct variant, with "?" exactly where the
+  // pattern has bits set.
+  std::set<std::string> variants;
+  for (int pattern = 0; pattern < 32; ++pattern) {
+    const std::string s =
+        encoder.ToString(WildKeyEncoder::Wildize(key, pattern));
+    bool matches = s.size() == 5;
+    for (int i = 0; matches && i < 5; ++i) {
+      matches = (s[i] == '?') == ((pattern >> i) & 1) &&
+                (s[i] == '?' || s[i] == "ABATE"[i]);
+    }
+    EXPECT(matches);
+    variants.insert(s);
+  }
+  EXPECT(variants.size() == 32);
+
+  // Only the first WILDIZE_ALL_BEYOND letters are kept, and wildizable.
+  WildKey long_key;
+  EXPECT(encoder.Encode(
+      util->PartsOf(util->Key("INTERNATIONALIZATION"), false), &long_key));
+  EXPECT(long_key.Length() == 20);
+  EXPECT(WildKeyEncoder::NumWildizable(long_key) == WILDIZE_ALL_BEYOND);
+  EXPECT(encoder.ToString(WildKeyEncoder::Wildize(long_key, 0x201)) ==
+         "?NTERNATI???????????");
+  EXPECT(!WildKeyEncoder::AllWild(WildKeyEncoder::Wildize(long_key, 0x1ff)));
+  EXPECT(WildKeyEncoder::AllWild(WildKeyEncoder::Wildize(long_key, 0x3ff)));
+
+  // WildKeyMap, against a std::map, over enough keys to make it grow.
+  WildKeyMap map;
+  std::map<std::string, int64_t> expected;
+  const std::vector<std::string> words = {
+      "ABATE", "ABACUS", "BATHE", "INTERNATIONALIZATION", "CABBAGE",
+      "ABCDEFGHIJKL", "ZEBRA", "A"};
+  for (size_t w = 0; w < words.size(); ++w) {
+    WildKey word_key;
+    EXPECT(encoder.Encode(util->PartsOf(util->Key(words[w]), false),
+                          &word_key));
+    const int num_patterns = 1 << WildKeyEncoder::NumWildizable(word_key);
+    for (int pattern = 0; pattern < num_patterns; ++pattern) {
+      const WildKey v = WildKeyEncoder::Wildize(word_key, pattern);
+      map.Add(v, w + 1);
+      expected[encoder.ToString(v)] += w + 1;
+    }
+  }
+  EXPECT(map.Size() == expected.size());
+  size_t num_matched = 0;
+  map.ForEach([&](const WildKey& k, int64_t value) {
+    num_matched += expected[encoder.ToString(k)] == value;
+  });
+  EXPECT(num_matched == expected.size());
+  EXPECT(map.Find(WildKeyEncoder::Wildize(key, 0x1f)) ==
+         expected["?????"]);
+  EXPECT(expected["?????"] == 1 + 3 + 7);  // ABATE, BATHE, ZEBRA.
+  WildKey absent;
+  EXPECT(encoder.Encode(util->PartsOf(util->Key("ABATES"), false), &absent));
+  EXPECT(map.Find(absent) == 0);
+}
+
+void TestParseArgs() {
+  const char* argv[] = {"prog", "English", "--threads=4", "words.txt",
+                        "--resume", "--input=a=b.txt", "--input_x="};
+  std::vector<std::string> args;
+  std::map<std::string, std::string> flags;
+  EXPECT(ParseArgs(7, const_cast<char**>(argv),
+                   {"threads", "resume", "input", "input_x", "unused"},
+                   &args, &flags));
+  EXPECT(args == std::vector<std::string>({"English", "words.txt"}));
+  EXPECT(flags.size() == 4);
+  EXPECT(flags["threads"] == "4");
+  EXPECT(flags["resume"] == "true");
+  EXPECT(flags["input"] == "a=b.txt");
+  EXPECT(flags["input_x"] == "");
+  EXPECT(flags.count("unused") == 0);
+
+  args.clear();
+  flags.clear();
+  printf("(Expect an \"Unknown flag\" complaint.)\n");
+  EXPECT(!ParseArgs(3, const_cast<char**>(argv), {"resume"}, &args, &flags));
+}
+
+void TestPopularityCounts() {
+  PopularityCounts counts;
+  counts.fingerprint = 0x0123456789abcdefULL;
+  counts.input_offset = 1LL << 40;
+  counts.num_lines = 12345;
+  counts.num_doc_lines = 42;
+  counts.num_probes = 98765;
+  counts.num_hits = 4321;
+  counts.counts = {0, 3, 0, 1LL << 35, 7};
+
+  const std::string file = TestFile("counts");
+  EXPECT(WritePopularityCounts(file.c_str(), counts));
+  PopularityCounts read;
+  EXPECT(ReadPopularityCounts(file.c_str(), &read));
+  EXPECT(read.fingerprint == counts.fingerprint);
+  EXPECT(read.input_offset == counts.input_offset);
+  EXPECT(read.num_lines == counts.num_lines);
+  EXPECT(read.num_doc_lines == counts.num_doc_lines);
+  EXPECT(read.num_probes == counts.num_probes);
+  EXPECT(read.num_hits == counts.num_hits);
+  EXPECT(read.counts == counts.counts);
+
+  // A truncated file is rejected.
+  FILE* fp = fopen(file.c_str(), "r+");
+  EXPECT(fp && ftruncate(fileno(fp), 20) == 0);
+  if (fp) fclose(fp);
+  printf("(Expect a \"not a valid counts file\" complaint.)\n");
+  EXPECT(!ReadPopularityCounts(file.c_str(), &read));
+
+  // So is one whose counts size is larger than the file (instead of
+  // allocating for it).
+  EXPECT(WritePopularityCounts(file.c_str(), counts));
+  fp = fopen(file.c_str(), "r+");
+  const int64_t huge_size = 1LL << 60;
+  EXPECT(fp && fseek(fp, 8 + 6 * sizeof(int64_t), SEEK_SET) == 0 &&
+         fwrite(&huge_size, sizeof(huge_size), 1, fp) == 1);
+  if (fp) fclose(fp);
+  printf("(Expect a \"not a valid counts file\" complaint.)\n");
+  EXPECT(!ReadPopularityCounts(file.c_str(), &read));
+  unlink(file.c_str());
+
+  // Shards only add up with matching fingerprints.
+  PopularityCounts total;
+  EXPECT(AddPopularityCounts(counts, &total));
+  EXPECT(AddPopularityCounts(counts, &total));
+  EXPECT(total.fingerprint == counts.fingerprint);
+  EXPECT(total.counts[3] == 2 * counts.counts[3]);
+  EXPECT(total.num_lines == 2 * counts.num_lines);
+  PopularityCounts other = counts;
+  other.fingerprint ^= 1;
+  EXPECT(!AddPopularityCounts(other, &total));
+  EXPECT(total.counts[3] == 2 * counts.counts[3]);
+
+  // Document frequencies, and the phrases of the open document.
+  counts.doc_counts = {0, 1, 0, 2, 1};
+  counts.open_doc_phrases = {1, 3};
+  EXPECT(WritePopularityCounts(file.c_str(), counts));
+  EXPECT(ReadPopularityCounts(file.c_str(), &read));
+  EXPECT(read.doc_counts == counts.doc_counts);
+  EXPECT(read.open_doc_phrases == counts.open_doc_phrases);
+  unlink(file.c_str());
+  EXPECT(AddPopularityCounts(counts, &total));
+  EXPECT(total.doc_counts == std::vector<int64_t>({0, 1, 0, 2, 1}));
+
+  Lexicon lexicon1, lexicon2;
+  lexicon1.phrase_infos.resize(2);
+  lexicon1.phrase_infos[0].normalized = "ab";
+  lexicon1.phrase_infos[1].normalized = "c";
+  lexicon2.phrase_infos.resize(2);
+  lexicon2.phrase_infos[0].normalized = "a";
+  lexicon2.phrase_infos[1].normalized = "bc";
+  EXPECT(LexiconFingerprint(lexicon1) != LexiconFingerprint(lexicon2));
+  EXPECT(LexiconFingerprint(lexicon1) == LexiconFingerprint(lexicon1));
+}
+
+/**
+ * Mixes i into a well-spread 64-bit hash.
+ */
+uint64_t TestHash(uint64_t i) {
+  i = (i + 1) * 0x9e3779b97f4a7c15ULL;
+  i ^= i >> 31;
+  i *= 0xbf58476d1ce4e5b9ULL;
+  return i ^ (i >> 29);
+}
+
+void TestDocFreqCounter() {
+  // Documents {1, 1, 2}, {1, 3}, {} and {3, ...}, which goes on in the next
+  // batch with {3, 4}.
+  DocFreqCounter counter(5);
+  std::vector<int64_t> doc_counts(5);
+  counter.Apply({1, 1, 2, 1, 3, 3}, {0, 3, 5, 5}, &doc_counts);
+  EXPECT(doc_counts == std::vector<int64_t>({0, 2, 1, 2, 0}));
+  counter.Apply({3, 4}, {}, &doc_counts);
+  EXPECT(doc_counts == std::vector<int64_t>({0, 2, 1, 2, 1}));
+  std::vector<int64_t> open_doc_phrases;
+  counter.Snapshot(&open_doc_phrases);
+  EXPECT(open_doc_phrases == std::vector<int64_t>({3, 4}));
+
+  // A restored counter carries on with the open document.
+  DocFreqCounter restored(5);
+  EXPECT(restored.Restore(open_doc_phrases));
+  restored.Apply({3, 0}, {}, &doc_counts);
+  EXPECT(doc_counts == std::vector<int64_t>({1, 2, 1, 2, 1}));
+  restored.Apply({3, 0}, {0}, &doc_counts);
+  EXPECT(doc_counts == std::vector<int64_t>({2, 2, 1, 3, 1}));
+  EXPECT(!restored.Restore({5}));
+}
+
+void TestLetterizedPrunedPartsOfText() {
+  // Texts made of chars from all scripts, punctuation and runs of spaces,
+  // normalized token by token (twice, so that the second time comes from
+  // the cache) must match normalizing them whole, for every config.
+  std::vector<std::string> chars = {" ", " ", " ", "  ", "-", "'", ".",
+                                    ",", "(", "\t", "1", "&"};
+  for (const auto& pair : lufz_utf8chars) {
+    chars.push_back(pair.first);
+  }
+  std::vector<std::string> texts = {
+      "", " ", "The quick brown fox", "  leading and trailing  ",
+      "L'Été d'un garçon", "rock-'n'-roll, 1999!"};
+  for (uint64_t i = 0; i < 300; ++i) {
+    std::string text;
+    const int len = TestHash(i) % 40;
+    for (int j = 0; j < len; ++j) {
+      text += chars[TestHash(i * 64 + j) % chars.size()];
+    }
+    texts.push_back(text);
+  }
+  for (const auto& pair : lufz_configs) {
+    LufzUtil util(pair.first);
+    std::unordered_map<std::string, std::string> cache;
+    size_t num_same = 0;
+    for (int round = 0; round < 2; ++round) {
+      for (const std::string& text : texts) {
+        num_same += util.StrLetterizedPrunedPartsOfText(text, &cache) ==
+                    util.StrLetterizedPrunedPartsOf(text);
+      }
+    }
+    if (num_same != 2 * texts.size()) {
+      printf("Config %s:\n", pair.first.c_str());
+    }
+    EXPECT(num_same == 2 * texts.size());
+  }
+}
+
+void TestNgramDiscoverer() {
+  // Five heavy hitters, which are a third of all occurrences, among 1000
+  // rarer n-grams, with few enough buffered counts to spill more than
+  // MAX_MERGE_FAN_IN runs.
+  const std::string prefix = TestFile("ngrams");
+  NgramDiscoverer discoverer(prefix, 20, 50);
+  std::map<std::string, int64_t> expected;
+  for (uint64_t i = 0; i < 30000; ++i) {
+    const std::string ngram = i % 3 == 0 ?
+        "heavy " + std::to_string(i / 3 % 5) :
+        "rare " + std::to_string(TestHash(i) % 1000);
+    EXPECT(discoverer.Add(ngram, 1 + (i % 7 == 0)));
+    expected[ngram] += 1 + (i % 7 == 0);
+  }
+  EXPECT(discoverer.NumSpilledRuns() > NgramDiscoverer::MAX_MERGE_FAN_IN);
+  std::vector<std::pair<std::string, int64_t>> top;
+  EXPECT(discoverer.Finish(2, 5, &top));
+  EXPECT(top.size() == 5);
+  for (size_t i = 0; i < top.size(); ++i) {
+    // The heavy hitters were candidates from the start, so their counts
+    // are exact.
+    EXPECT(top[i].first.substr(0, 6) == "heavy ");
+    EXPECT(top[i].second == expected[top[i].first]);
+    EXPECT(i == 0 || top[i - 1].second >= top[i].second);
+  }
+  // The counts of the other candidates are lower bounds.
+  NgramDiscoverer discoverer2(prefix, 20, 50);
+  for (uint64_t i = 0; i < 30000; ++i) {
+    discoverer2.Add("rare " + std::to_string(TestHash(i) % 1000), 1);
+  }
+  EXPECT(discoverer2.Finish(1, 100, &top));
+  EXPECT(top.size() > 0 && top.size() <= 20);
+  std::map<std::string, int64_t> expected2;
+  for (uint64_t i = 0; i < 30000; ++i) {
+    expected2["rare " + std::to_string(TestHash(i) % 1000)]++;
+  }
+  size_t num_bounded = 0;
+  for (const auto& [ngram, count] : top) {
+    num_bounded += count <= expected2[ngram];
+  }
+  EXPECT(num_bounded == top.size());
+  // The spilled runs are gone.
+  EXPECT(access((prefix + ".run0").c_str(), F_OK) != 0);
+}
+
+void TestCooccurrenceCounter() {
+  EXPECT(CooccurrenceCounter::Pair(3, 7) == CooccurrenceCounter::Pair(7, 3));
+  EXPECT(CooccurrenceCounter::Pair(3, 7) >> 32 == 3);
+  // Phrases 0-2 always co-occur, 3 and 4 once each with 0, in buffers from
+  // two batches split up among three threads.
+  const int kNumThreads = 3;
+  std::vector<std::vector<uint64_t>> batch1(kNumThreads), batch2(kNumThreads);
+  std::vector<int64_t> pair_counts(5);
+  int64_t num_pairs = 0;
+  auto add = [&](std::vector<std::vector<uint64_t>>* batch, int a, int b) {
+    const uint64_t pair = CooccurrenceCounter::Pair(a, b);
+    (*batch)[CooccurrenceCounter::ShardGroup(pair, kNumThreads)]
+        .push_back(pair);
+    pair_counts[a]++;
+    pair_counts[b]++;
+    num_pairs++;
+  };
+  for (int i = 0; i < 10; ++i) {
+    add(i % 2 ? &batch1 : &batch2, 0, 1);
+    add(i % 2 ? &batch1 : &batch2, 1, 2);
+  }
+  add(&batch1, 0, 3);
+  add(&batch2, 4, 0);
+  CooccurrenceCounter counter(100);
+  counter.Add({&batch1, &batch2});
+  EXPECT(counter.NumPairs() == 4);
+  std::vector<std::vector<CooccurrenceCounter::Associate>> associates;
+  counter.TopAssociates(pair_counts, num_pairs, 1, 10, &associates);
+  EXPECT(associates.size() == 5);
+  // P(0, 3) = 1/22, P(0) = 12/44 and P(3) = 1/44.
+  EXPECT(associates[3].size() == 1 && associates[3][0].index == 0 &&
+         associates[3][0].count == 1 &&
+         fabs(associates[3][0].pmi - log(4.0 * 22 / 12)) < 1e-9);
+  EXPECT(associates[1].size() == 2 && associates[1][0].index == 2 &&
+         associates[1][1].index == 0 &&
+         fabs(associates[1][0].pmi - log(10.0 * 4 * 22 / (20 * 10))) < 1e-9);
+  // Phrase 0 has the rare phrases first, as they have the highest PMI.
+  EXPECT(associates[0].size() == 3 && associates[0][0].index == 3 &&
+         associates[0][1].index == 4 && associates[0][2].index == 1);
+  counter.TopAssociates(pair_counts, num_pairs, 2, 1, &associates);
+  EXPECT(associates[0].size() == 1 && associates[0][0].index == 1);
+  EXPECT(associates[3].empty());
+  // Pruning keeps the most frequent pairs.
+  CooccurrenceCounter small(3);
+  small.Add({&batch1, &batch2});
+  EXPECT(small.NumPairs() <= 3);
+  small.TopAssociates(pair_counts, num_pairs, 1, 10, &associates);
+  EXPECT(associates[3].empty() && associates[4].empty());
+  EXPECT(associates[1].size() == 2);
+}
+
+void TestCuckooFilter() {
+  const size_t memory_bytes = 1 << 20;
+  CuckooFilter filter(memory_bytes);
+  EXPECT(filter.Capacity() == memory_bytes / sizeof(uint32_t));
+  const int n = 100000;
+  int num_new = 0;
+  for (int i = 0; i < n; ++i) {
+    num_new += !filter.TestAndInsert(TestHash(i));
+  }
+  EXPECT(num_new == n);
+  EXPECT(filter.Size() == n);
+  int num_seen = 0;
+  for (int i = 0; i < n; ++i) {
+    num_seen += filter.TestAndInsert(TestHash(i));
+  }
+  EXPECT(num_seen == n);
+  EXPECT(filter.Size() == n);
+
+  filter.Clear();
+  EXPECT(filter.Size() == 0);
+  EXPECT(!filter.TestAndInsert(TestHash(0)));
+
+  // Overfilling resets the filter, and it keeps working. A fresh filter fed
+  // the same hashes makes the same decisions (which resuming relies on).
+  CuckooFilter replayed(memory_bytes);
+  replayed.TestAndInsert(TestHash(0));
+  int num_same = 0;
+  for (size_t i = 0; i < 3 * filter.Capacity(); ++i) {
+    const uint64_t hash = TestHash(n + i / 2);
+    num_same += filter.TestAndInsert(hash) == replayed.TestAndInsert(hash);
+  }
+  EXPECT(num_same == int(3 * filter.Capacity()));
+  EXPECT(filter.NumResets() > 0);
+  EXPECT(filter.NumResets() == replayed.NumResets());
+  EXPECT(filter.Size() <= filter.Capacity());
+  EXPECT(!filter.TestAndInsert(TestHash(10 * n + 3 * filter.Capacity())));
+  EXPECT(filter.TestAndInsert(TestHash(10 * n + 3 * filter.Capacity())));
+}
+
+std::vector<std::string> ReadLines(const std::string& file, int64_t skip_to) {
+  std::vector<std::string> lines;
+  LineReader reader;
+  if (!reader.Open(file) || (skip_to > 0 && !reader.SkipTo(skip_to))) {
+    EXPECT(false);
+    return lines;
+  }
+  int64_t offset = skip_to;
+  std::string_view line;
+  while (reader.Next(&line)) {
+    offset += line.size();
+    EXPECT(reader.Offset() == offset);
+    lines.emplace_back(line);
+  }
+  EXPECT(!reader.Failed());
+  return lines;
+}
+
+void IgnoreSignal(int) {}
+
+void TestLineReader() {
+  // Lines that straddle the reader's block boundaries, one line longer
+  // than a block, an empty line, and a last line with no newline.
+  std::vector<std::string> lines;
+  int64_t size = 0;
+  for (int i = 0; size < 3 * LineReader::BLOCK_SIZE; ++i) {
+    std::string line;
+    if (i == 1000) {
+      line = std::string(LineReader::BLOCK_SIZE + 12345, 'x') + "\n";
+    } else if (i == 1001) {
+      line = "\n";
+    } else {
+      line = "line " + std::to_string(i) + std::string(i % 97, '.') + "\n";
+    }
+    size += line.size();
+    lines.push_back(line);
+  }
+  lines.push_back("no newline");
+  std::string data;
+  for (const std::string& line : lines) {
+    data += line;
+  }
+  const int skip_lines = lines.size() / 2;
+  int64_t skip_to = 0;
+  for (int i = 0; i < skip_lines; ++i) {
+    skip_to += lines[i].size();
+  }
+  const std::vector<std::string> rest(lines.begin() + skip_lines,
+                                      lines.end());
+
+  // A regular file is mmapped.
+  const std::string file = TestFile("lines.txt");
+  FILE* fp = fopen(file.c_str(), "w");
+  EXPECT(fp && fwrite(data.data(), data.size(), 1, fp) == 1);
+  if (fp) fclose(fp);
+  EXPECT(ReadLines(file, 0) == lines);
+  EXPECT(ReadLines(file, skip_to) == rest);
+  unlink(file.c_str());
+
+  // A pipe is read in blocks.
+  const std::string fifo = TestFile("lines.fifo");
+  EXPECT(mkfifo(fifo.c_str(), 0600) == 0);
+  for (int64_t skip : {int64_t(0), skip_to}) {
+    std::thread writer([&fifo, &data]() {
+      FILE* fp = fopen(fifo.c_str(), "w");
+      if (fp) {
+        fwrite(data.data(), data.size(), 1, fp);
+        fclose(fp);
+      }
+    });
+    EXPECT(ReadLines(fifo, skip) == (skip > 0 ? rest : lines));
+    writer.join();
+  }
+
+  // A read interrupted by a signal (with no SA_RESTART) is retried.
+  struct sigaction action = {};
+  action.sa_handler = IgnoreSignal;
+  struct sigaction old_action;
+  EXPECT(sigaction(SIGUSR1, &action, &old_action) == 0);
+  const pthread_t reader_thread = pthread_self();
+  std::thread writer([&fifo, &data, reader_thread]() {
+    FILE* fp = fopen(fifo.c_str(), "w");
+    if (fp) {
+      usleep(100000);
+      pthread_kill(reader_thread, SIGUSR1);
+      usleep(100000);
+      fwrite(data.data(), data.size(), 1, fp);
+      fclose(fp);
+    }
+  });
+  EXPECT(ReadLines(fifo, skip_to) == rest);
+  writer.join();
+  sigaction(SIGUSR1, &old_action, nullptr);
+  unlink(fifo.c_str());
+
+  // A read error (here, reading a directory) is not taken as the end.
+  printf("(Expect an \"Error reading\" complaint.)\n");
+  LineReader reader;
+  std::string_view line;
+  EXPECT(reader.Open("/tmp"));
+  EXPECT(!reader.Next(&line));
+  EXPECT(reader.Failed());
+}
+
+void TestKeyPhraseSorter(LufzUtil* util) {
+  WildKeyEncoder encoder;
+  std::vector<KeyPhrase> pairs;
+  const std::vector<std::string> words = {
+      "ABATE", "BATHE", "ABATE", "ZEBRA", "ABACUS", "BATHE", "ZEBRA"};
+  for (size_t w = 0; w < words.size(); ++w) {
+    WildKey key;
+    EXPECT(encoder.Encode(util->PartsOf(util->Key(words[w]), false), &key));
+    const int num_patterns = 1 << WildKeyEncoder::NumWildizable(key);
+    for (int pattern = 0; pattern < num_patterns; ++pattern) {
+      pairs.push_back(KeyPhrase::Make(WildKeyEncoder::Wildize(key, pattern),
+                                      int(w)));
+    }
+  }
+  std::vector<KeyPhrase> expected = pairs;
+  std::stable_sort(expected.begin(), expected.end(),
+                   [](const KeyPhrase& a, const KeyPhrase& b) {
+                     return a.KeyLess(b);
+                   });
+  // All in memory, and spilled in many small runs (whose boundaries fall
+  // within runs of equal keys).
+  for (size_t max_buffered : {size_t(1000), size_t(7), size_t(1)}) {
+    KeyPhraseSorter sorter(max_buffered, 2);
+    for (const KeyPhrase& pair : pairs) {
+      EXPECT(sorter.Add(pair));
+    }
+    EXPECT(sorter.Finish());
+    EXPECT((sorter.NumSpilledRuns() > 1) == (max_buffered < pairs.size()));
+    EXPECT(sorter.NumPairs() == pairs.size());
+    std::vector<KeyPhrase> sorted;
+    KeyPhrase pair;
+    while (sorter.Next(&pair)) {
+      sorted.push_back(pair);
+    }
+    EXPECT(!sorter.Failed());
+    bool same = sorted.size() == expected.size();
+    for (size_t i = 0; same && i < sorted.size(); ++i) {
+      same = sorted[i].SameKey(expected[i]) &&
+             sorted[i].phrase == expected[i].phrase;
+    }
+    EXPECT(same);
+  }
+}
+
+/**
+ * Returns the contents of file (empty if it cannot be read).
+ */
+std::string ReadFile(const std::string& file) {
+  std::string contents;
+  FILE* fp = fopen(file.c_str(), "rb");
+  if (fp) {
+    char buf[65536];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+      contents.append(buf, n);
+    }
+    fclose(fp);
+  }
+  return contents;
+}
+
+/**
+ * Writes a generated lexicon for index-word-list, with enough short words
+ * over few letters for many keys to survive pruning, long ones for the
+ * suffix index, and pronunciations for some. RemoveTestLexicon() removes
+ * it.
+ */
+bool WriteTestLexicon() {
+  FILE* lfp = fopen(TestFile("lexicon.txt").c_str(), "w");
+  FILE* pfp = fopen(TestFile("phones.txt").c_str(), "w");
+  FILE* cfp = fopen(TestFile("crossed.txt").c_str(), "w");
+  if (!lfp || !pfp || !cfp) return false;
+  for (uint64_t i = 0; i < 30000; ++i) {
+    std::string word;
+    const int len = (i % 5 == 0 ? 11 : 7) + TestHash(i) % 3;
+    for (int j = 0; j < len; ++j) {
+      word += "ABCD"[TestHash(i * 16 + j + 1) % 4];
+    }
+    fprintf(lfp, "%s\n", word.c_str());
+    if (i % 10 == 0) {
+      fprintf(pfp, "%s\t%c %c\n", word.c_str(), word[0], word[1]);
+    }
+  }
+  fclose(lfp);
+  fclose(pfp);
+  fclose(cfp);
+  return true;
+}
+
+void RemoveTestLexicon() {
+  for (const char* name : {"lexicon.txt", "phones.txt", "crossed.txt"}) {
+    unlink(TestFile(name).c_str());
+  }
+}
+
+/**
+ * Runs ./index-word-list with flags on the test lexicon, writing the
+ * output to output_file.
+ */
+bool RunIndexWordList(const std::string& flags,
+                      const std::string& output_file) {
+  const std::string command = "./index-word-list English " +
+      TestFile("lexicon.txt") + " " + TestFile("phones.txt") + " " +
+      TestFile("crossed.txt") + " " + flags + " > " + output_file +
+      " 2> /dev/null";
+  return system(command.c_str()) == 0;
+}
+
+void TestIndexBuilders() {
+  EXPECT(WriteTestLexicon());
+  // The counting builder with one thread is the reference.
+  std::vector<std::string> outputs;
+  for (const char* flags : {
+           "--index_builder=count --threads=1",
+           "--index_builder=count --threads=3",
+           "--index_builder=sort --threads=1",
+           "--index_builder=sort --threads=4 --sort_buffer_mb=1"}) {
+    const std::string output = TestFile("index.js");
+    EXPECT(RunIndexWordList(std::string("--extra_sections=all ") + flags,
+                            output));
+    outputs.push_back(ReadFile(output));
+    unlink(output.c_str());
+  }
+  EXPECT(outputs[0].size() > 100000);
+  for (const std::string& output : outputs) {
+    EXPECT(output == outputs[0]);
+  }
+  RemoveTestLexicon();
+}
+
+void TestOutputWriter() {
+  EXPECT(OutputWriter::EscapeJson("A plain 'string'") == "A plain 'string'");
+  EXPECT(OutputWriter::EscapeJson("a\"b\\c\n\x01`$") ==
+         R"(a\"b\\c\u000a\u0001`$)");
+  // Inside a template literal, the backslashes of the JSON escapes are
+  // escaped themselves, and so are backquotes and dollar signs.
+  EXPECT(OutputWriter::EscapeJson("a\"b\\c\n`${x}", true) ==
+         R"(a\\"b\\\\c\\u000a\`\${x})");
+  EXPECT(OutputWriter::EscapeJson("`$", false) == "`$");
+
+  // Small pieces get buffered, big ones are written through, and the
+  // output is all there, in order.
+  const std::string file = TestFile("writer.txt");
+  FILE* fp = fopen(file.c_str(), "w");
+  EXPECT(fp);
+  if (!fp) return;
+  std::string expected;
+  {
+    OutputWriter out(fp);
+    for (int i = 0; i < 500000; ++i) {
+      out.AppendInt(i - 250000);
+      out.Append(',');
+      expected += std::to_string(i - 250000) + ",";
+      if (i % 100000 == 0) {
+        const std::string big(OutputWriter::FLUSH_SIZE + i, 'a' + i % 26);
+        out.Append(big);
+        expected += big;
+      }
+    }
+    EXPECT(out.NumBytes() == int64_t(expected.size()));
+    EXPECT(out.Flush());
+    EXPECT(!out.Failed());
+  }
+  fclose(fp);
+  EXPECT(ReadFile(file) == expected);
+  unlink(file.c_str());
+
+  // Without a FILE*, everything stays in memory.
+  OutputWriter in_memory;
+  in_memory.Append("x = ");
+  in_memory.AppendInt(-42);
+  EXPECT(in_memory.Flush());
+  EXPECT(in_memory.Contents() == "x = -42");
+}
+
+/**
+ * Gunzips the contents of file into *data. Returns false if it is not a
+ * single valid gzip member.
+ */
+bool Gunzip(const std::string& file, std::string* data) {
+  const std::string gzipped = ReadFile(file);
+  z_stream zs = {};
+  // 16 + 15: a gzip header and trailer, and a 32KB window.
+  if (inflateInit2(&zs, 16 + 15) != Z_OK) {
+    return false;
+  }
+  zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(gzipped.data()));
+  zs.avail_in = gzipped.size();
+  data->clear();
+  int status = Z_OK;
+  char buffer[1 << 16];
+  while (status == Z_OK) {
+    zs.next_out = reinterpret_cast<Bytef*>(buffer);
+    zs.avail_out = sizeof(buffer);
+    status = inflate(&zs, Z_NO_FLUSH);
+    data->append(buffer, sizeof(buffer) - zs.avail_out);
+  }
+  inflateEnd(&zs);
+  return status == Z_STREAM_END && zs.avail_in == 0;
+}
+
+void TestGzipWriter() {
+  // Several blocks, with repeats across block boundaries (which the
+  // dictionaries take care of), written in pieces of all sizes.
+  std::string data;
+  for (uint64_t i = 0; data.size() < 3 * GzipWriter::BLOCK_SIZE + 12345;
+       ++i) {
+    data += "word" + std::to_string(TestHash(i) % 5000) + ",";
+  }
+  const std::string file = TestFile("gzip.gz");
+  std::string gunzipped;
+  for (int num_threads : {1, 4}) {
+    GzipWriter gzip(num_threads, Z_DEFAULT_COMPRESSION);
+    EXPECT(gzip.Open(file));
+    for (size_t pos = 0, i = 0; pos < data.size(); ++i) {
+      const size_t n =
+          std::min(data.size() - pos, size_t(TestHash(i) % 100000));
+      gzip.Write(std::string_view(data).substr(pos, n));
+      pos += n;
+    }
+    EXPECT(gzip.Close());
+    EXPECT(gzip.NumBytesIn() == int64_t(data.size()));
+    EXPECT(gzip.NumBytesOut() == int64_t(ReadFile(file).size()));
+    EXPECT(gzip.NumBytesOut() < gzip.NumBytesIn() / 2);
+    EXPECT(Gunzip(file, &gunzipped));
+    EXPECT(gunzipped == data);
+  }
+
+  // Nothing written, and writing through an OutputWriter.
+  {
+    GzipWriter gzip(2, Z_BEST_SPEED);
+    EXPECT(gzip.Open(file));
+    EXPECT(gzip.Close());
+    EXPECT(Gunzip(file, &gunzipped) && gunzipped.empty());
+  }
+  {
+    GzipWriter gzip(2, Z_BEST_SPEED);
+    EXPECT(gzip.Open(file));
+    FILE* null = fopen("/dev/null", "w");
+    {
+      OutputWriter out(null);
+      out.SetGzip(&gzip);
+      out.Append(data);
+      out.Append('.');
+      EXPECT(out.Flush());
+    }
+    fclose(null);
+    EXPECT(gzip.Close());
+    EXPECT(Gunzip(file, &gunzipped) && gunzipped == data + ".");
+  }
+
+  // zlib failing (here on a bad compression level) makes Close() fail.
+  {
+    printf("(Expect an \"Error compressing\" complaint.)\n");
+    GzipWriter gzip(2, 42);
+    EXPECT(gzip.Open(file));
+    gzip.Write(data);
+    EXPECT(!gzip.Close());
+  }
+  unlink(file.c_str());
+}
+
+/**
+ * Finds the entry for array name in the header of a bundle, and checks
+ * that its type, length and bytes (at its offset in bundle) are as
+ * expected.
+ */
+bool BundleHasArray(const std::string& bundle, const std::string& header,
+                    const std::string& name, const std::string& type,
+                    const void* data, int64_t length, int element_size) {
+  const std::string prefix = "\"" + name + "\": {\"type\": \"" + type +
+      "\", \"offset\": ";
+  const size_t pos = header.find(prefix);
+  long long offset = -1, num = -1;
+  if (pos == std::string::npos ||
+      sscanf(header.c_str() + pos + prefix.size(), "%lld, \"length\": %lld",
+             &offset, &num) != 2) {
+    return false;
+  }
+  const size_t size = length * element_size;
+  return offset % 8 == 0 && num == length &&
+         size_t(offset) + size <= bundle.size() &&
+         (size == 0 || memcmp(bundle.data() + offset, data, size) == 0);
+}
+
+void TestBundleWriter() {
+  BundleWriter writer;
+  writer.SetString("language", "Eng\"lish\"");
+  writer.SetStrings("letters", {"A", "B", "\\"});
+  const std::vector<uint8_t> u8 = {1, 2, 3};
+  const std::vector<uint16_t> u16 = {1, 65535, 7};
+  const std::vector<int32_t> i32 = {-1, 0, 1 << 30};
+  std::vector<uint32_t> u32;
+  for (uint32_t i = 0; i < 1000; ++i) {
+    u32.push_back(i * 4000000);
+  }
+  writer.AddUint8("u8", u8);
+  writer.AddUint16("u16", u16);
+  writer.AddInt32("i32", i32);
+  writer.AddUint32("u32", u32);
+  writer.AddUint8("empty", {});
+  writer.AddStrings("words", {"AB", "", "CDE"});
+  EXPECT(writer.NumArrayBytes() == 3 + 6 + 12 + 4000 + 0 + 5 + 16);
+  const std::string file = TestFile("bundle");
+  EXPECT(writer.Write(file));
+  const std::string bundle = ReadFile(file);
+  unlink(file.c_str());
+  EXPECT(bundle.size() > 16 && bundle.substr(0, 8) == "LUFZBNDL");
+  if (bundle.size() <= 16) return;
+  uint32_t version, header_length;
+  memcpy(&version, bundle.data() + 8, 4);
+  memcpy(&header_length, bundle.data() + 12, 4);
+  EXPECT(version == uint32_t(BUNDLE_FORMAT_VERSION));
+  EXPECT(header_length % 8 == 0 && 16 + header_length <= bundle.size());
+  const std::string header = bundle.substr(16, header_length);
+  EXPECT(header.find("\"language\": \"Eng\\\"lish\\\"\"") !=
+         std::string::npos);
+  EXPECT(header.find("\"letters\": [\"A\", \"B\", \"\\\\\"]") !=
+         std::string::npos);
+  EXPECT(BundleHasArray(bundle, header, "u8", "Uint8", u8.data(), 3, 1));
+  EXPECT(BundleHasArray(bundle, header, "u16", "Uint16", u16.data(), 3, 2));
+  EXPECT(BundleHasArray(bundle, header, "i32", "Int32", i32.data(), 3, 4));
+  EXPECT(BundleHasArray(bundle, header, "u32", "Uint32", u32.data(), 1000,
+                        4));
+  EXPECT(BundleHasArray(bundle, header, "empty", "Uint8", nullptr, 0, 1));
+  const uint32_t offsets[] = {0, 2, 2, 5};
+  EXPECT(BundleHasArray(bundle, header, "words.bytes", "Uint8", "ABCDE", 5,
+                        1));
+  EXPECT(BundleHasArray(bundle, header, "words.offsets", "Uint32", offsets, 4,
+                        4));
+}
+
+void TestVlq() {
+  const std::vector<int64_t> ids = {
+      0, 1, 31, 32, 33, 1000, 1 << 20, 1LL << 40, (1LL << 40) + 1};
+  OutputWriter out;
+  out.AppendVlq(ids.begin(), ids.begin() + 3);
+  // Deltas 0, 1, 30.
+  EXPECT(out.Contents() == "ABe");
+  OutputWriter out2;
+  out2.AppendVlq(ids.begin(), ids.end());
+  std::vector<int64_t> decoded;
+  EXPECT(OutputWriter::DecodeVlq(out2.Contents(), &decoded));
+  EXPECT(decoded == ids);
+  // A delta of 32 takes two digits: 32|0, then 1.
+  OutputWriter out3;
+  const std::vector<int> two = {0, 32};
+  out3.AppendVlq(two.begin(), two.end());
+  EXPECT(out3.Contents() == "AgB");
+  // Random sorted lists, with small and big gaps.
+  for (uint64_t seed = 0; seed < 100; ++seed) {
+    std::vector<int64_t> sorted;
+    int64_t value = 0;
+    for (uint64_t i = 0; i < seed * 10; ++i) {
+      value += TestHash(seed * 1000 + i) % (i % 2 ? 40 : 100000);
+      sorted.push_back(value);
+    }
+    OutputWriter list;
+    list.AppendVlq(sorted.begin(), sorted.end());
+    EXPECT(OutputWriter::DecodeVlq(list.Contents(), &decoded));
+    EXPECT(decoded == sorted);
+  }
+
+  EXPECT(OutputWriter::DecodeVlq("", &decoded) && decoded.empty());
+  EXPECT(!OutputWriter::DecodeVlq("Ag", &decoded));  // Ends mid-value.
+  EXPECT(!OutputWriter::DecodeVlq("A!", &decoded));  // Not a digit.
+  EXPECT(!OutputWriter::DecodeVlq(std::string_view("A\0", 2), &decoded));
+
+  // The decoder at the end of the output gives back the same exetLexicon
+  // as the plain output (checked with node, if there is one).
+  if (system("node --version > /dev/null 2>&1") != 0) {
+    printf("(No node found, so not checking the JavaScript decoder.)\n");
+    return;
+  }
+  EXPECT(WriteTestLexicon());
+  const std::string plain = TestFile("plain.js");
+  const std::string vlq = TestFile("vlq.js");
+  const std::string script = TestFile("compare.js");
+  EXPECT(RunIndexWordList("--extra_sections=all", plain));
+  EXPECT(RunIndexWordList("--extra_sections=all --posting_encoding=vlq",
+                          vlq));
+  EXPECT(ReadFile(vlq).size() < ReadFile(plain).size() / 2);
+  FILE* fp = fopen(script.c_str(), "w");
+  EXPECT(fp);
+  if (fp) {
+    fputs("const fs = require('fs');\n"
+          "function load(file) {\n"
+          "  eval(fs.readFileSync(file, 'utf8'));\n"
+          "  return JSON.stringify(exetLexicon);\n"
+          "}\n"
+          "process.exit(load(process.argv[2]) === load(process.argv[3]) ?"
+          " 0 : 1);\n", fp);
+    fclose(fp);
+  }
+  const std::string command = "node " + script + " " + plain + " " + vlq;
+  EXPECT(system(command.c_str()) == 0);
+  unlink(plain.c_str());
+  unlink(vlq.c_str());
+  unlink(script.c_str());
+  RemoveTestLexicon();
+}
+
+/**
+ * Runs all the self-tests, returning the number of failures.
+ */
+int RunSelfTests() {
+  LufzUtil util("English");
+  printf("Testing WildKeys...\n");
+  TestWildKeys(&util);
+  printf("Testing ParseArgs...\n");
+  TestParseArgs();
+  printf("Testing PopularityCounts...\n");
+  TestPopularityCounts();
+  printf("Testing DocFreqCounter...\n");
+  TestDocFreqCounter();
+  printf("Testing StrLetterizedPrunedPartsOfText...\n");
+  TestLetterizedPrunedPartsOfText();
+  printf("Testing NgramDiscoverer...\n");
+  TestNgramDiscoverer();
+  printf("Testing CooccurrenceCounter...\n");
+  TestCooccurrenceCounter();
+  printf("Testing CuckooFilter...\n");
+  TestCuckooFilter();
+  printf("Testing LineReader...\n");
+  TestLineReader();
+  printf("Testing KeyPhraseSorter...\n");
+  TestKeyPhraseSorter(&util);
+  printf("Testing --index_builder=count and sort (with ./index-word-list)...\n");
+  TestIndexBuilders();
+  printf("Testing OutputWriter...\n");
+  TestOutputWriter();
+  printf("Testing GzipWriter...\n");
+  TestGzipWriter();
+  printf("Testing BundleWriter...\n");
+  TestBundleWriter();
+  printf("Testing VLQ posting lists...\n");
+  TestVlq();
+  printf("%s: %d failures\n", num_failures ? "FAILED" : "PASSED",
+         num_failures);
+  return num_failures;
+}
 }
 
 int main(int argc, char* argv[]) {
+  if (argc > 1 && std::string(argv[1]) == "selftest") {
+    return RunSelfTests() > 0 ? 1 : 0;
+  }
 
   std::map<std::string, LufzUtil*> utils;
   for (const auto& pair : lufz_configs) {
@@ -6,13 +6,41 @@
 #include <set>
 #include <algorithm>
 #include <string>
+#include <string_view>
 #include <unordered_map>
 
+#include "lufz-reader.h"
 #include "lufz-utf8.h"
 #include "lufz-util.h"
 
 namespace lufz {
 
+bool ParseArgs(int argc, char* argv[],
+               const std::set<std::string>& known_flags,
+               std::vector<std::string>* args,
+               std::map<std::string, std::string>* flags) {
+  for (int i = 1; i < argc; i++) {
+    const std::string arg(argv[i]);
+    if (arg.substr(0, 2) != "--") {
+      args->push_back(arg);
+      continue;
+    }
+    std::string name = arg.substr(2);
+    std::string value = "true";
+    size_t eq = name.find('=');
+    if (eq != std::string::npos) {
+      value = name.substr(eq + 1);
+      name = name.substr(0, eq);
+    }
+    if (known_flags.count(name) == 0) {
+      fprintf(stderr, "Unknown flag: %s\n", arg.c_str());
+      return false;
+    }
+    (*flags)[name] = value;
+  }
+  return true;
+}
+
 LufzUtil::LufzUtil(const std::string& config_name) {
   if (lufz_configs.count(config_name) == 0) {
     fprintf(stderr, "No config named %s\n", config_name.c_str());
@@ -30,6 +58,23 @@ LufzUtil::LufzUtil(const std::string& config_name) {
     letter_indices_[c] = letters_.size();
     letters_.push_back(c);
   }
+  /**
+   * Normalizing each space-separated token separately is equivalent to
+   * normalizing the whole text as long as " " is a space and no
+   * conversion or other space can straddle or produce a " ".
+   */
+  tokenwise_ok_ = config_->spaces.count(" ") > 0;
+  for (const auto& a_to_b : config_->conversions) {
+    if (a_to_b.first.find(' ') != std::string::npos ||
+        a_to_b.second.find(' ') != std::string::npos) {
+      tokenwise_ok_ = false;
+    }
+  }
+  for (const std::string& sp : config_->spaces) {
+    if (sp != " " && sp.find(' ') != std::string::npos) {
+      tokenwise_ok_ = false;
+    }
+  }
 }
 
 std::string LufzUtil::Join(
@@ -264,6 +309,42 @@ std::vector<std::string> LufzUtil::LettersOf(
   return result;
 }
 
+const size_t MAX_TOKEN_CACHE_SIZE = 1 << 20;
+
+std::string LufzUtil::StrLetterizedPrunedPartsOfText(
+    const std::string& s,
+    std::unordered_map<std::string, std::string>* cache) {
+  if (!tokenwise_ok_) {
+    return StrLetterizedPrunedPartsOf(s);
+  }
+  std::string result;
+  size_t start = 0;
+  while (start < s.length()) {
+    size_t end = s.find(' ', start);
+    if (end == std::string::npos) {
+      end = s.length();
+    }
+    if (end > start) {
+      std::string token = s.substr(start, end - start);
+      auto it = cache->find(token);
+      if (it == cache->end()) {
+        if (cache->size() >= MAX_TOKEN_CACHE_SIZE) {
+          cache->clear();
+        }
+        it = cache->emplace(token, StrLetterizedPrunedPartsOf(token)).first;
+      }
+      if (!it->second.empty()) {
+        if (!result.empty()) {
+          result += ' ';
+        }
+        result += it->second;
+      }
+    }
+    start = end + 1;
+  }
+  return result;
+}
+
 bool LufzUtil::IsLetter(const std::vector<std::string>& chars) {
   int num_combiners = 0;
   for (int i = chars.size() - 1; i >= 0; i--) {
@@ -365,23 +446,21 @@ std::string LufzUtil::AgmKey(const std::string& s) {
 
 bool LufzUtil::ReadLexicon(const char* lexicon_file, Lexicon* lexicon, const char* crossed_words_file) {
   lexicon->phrase_infos.clear();
-  FILE* fp = !strcmp(lexicon_file, "-") ? stdin : fopen(lexicon_file, "r");
-  if (!fp) {
-    fprintf(stderr, "Could not open %s\n", lexicon_file);
+  LineReader reader;
+  if (!reader.Open(lexicon_file)) {
     return false;
   }
-  char buf[MAX_LINE_LENGTH];
+  std::string_view buf;
   int num_importances_found = 0;
   int num_lines = 0;
 
   std::set<std::string> crossed_words;
   if (crossed_words_file && strlen(crossed_words_file) > 0) {
-    FILE* cfp = fopen(crossed_words_file, "r");
-    if (!cfp) {
-      fprintf(stderr, "Could not open %s\n", crossed_words_file);
+    LineReader crossed_words_reader;
+    if (!crossed_words_reader.Open(crossed_words_file)) {
       return false;
     }
-    while (fgets(buf, sizeof(buf), cfp)) {
+    while (crossed_words_reader.Next(&buf)) {
       std::string crossed_word(buf);
       std::string normalized_crossed_word =
           StrLetterizedPrunedPartsOf(crossed_word);
@@ -389,7 +468,9 @@ bool LufzUtil::ReadLexicon(const char* lexicon_file, Lexicon* lexicon, const cha
         crossed_words.insert(normalized_crossed_word);
       }
     }
-    fclose(cfp);
+    if (crossed_words_reader.Failed()) {
+      return false;
+    }
     fprintf(stderr, "Read %d crossed words from %s\n", crossed_words.size(), crossed_words_file);
   }
 
@@ -401,9 +482,9 @@ bool LufzUtil::ReadLexicon(const char* lexicon_file, Lexicon* lexicon, const cha
   std::unordered_map<std::string, int> lexicon_index;
   int most_forms = 0;
   int most_forms_index = 0;
-  while (fgets(buf, sizeof(buf), fp)) {
+  while (reader.Next(&buf)) {
     ++num_lines;
-    buf[strcspn(buf, "\r\n")] = 0;  // Remove trailing newline
+    buf = buf.substr(0, buf.find_first_of("\r\n"));  // Remove trailing newline
     std::string line(buf);
     std::vector<std::string> line_parts = Split(line, "\t");
 
@@ -418,11 +499,11 @@ bool LufzUtil::ReadLexicon(const char* lexicon_file, Lexicon* lexicon, const cha
       char *buf_beyond_number = NULL;
       importance = strtold(line_parts[0].c_str(), &buf_beyond_number);
       if (isnan(importance) || isinf(importance)) {
-        fprintf(stderr, "Skipping [%s] as it has a weird importance score\n", buf);
+        fprintf(stderr, "Skipping [%s] as it has a weird importance score\n", line.c_str());
         continue;
       }
     } else {
-      fprintf(stderr, "Skipping [%s] as it has %d parts (need 1 or 2)\n", buf, line_parts.size());
+      fprintf(stderr, "Skipping [%s] as it has %d parts (need 1 or 2)\n", line.c_str(), line_parts.size());
       continue;
     }
     std::vector<std::string> parts;
@@ -468,7 +549,9 @@ bool LufzUtil::ReadLexicon(const char* lexicon_file, Lexicon* lexicon, const cha
       lexicon->letters.insert(letter);
     }
   }
-  fclose(fp);
+  if (reader.Failed()) {
+    return false;
+  }
 
   fprintf(stderr, "Read lexicon of size  %d: found %d importances\n",
           lexicon->phrase_infos.size(), num_importances_found);
@@ -3,8 +3,11 @@
 
 #include <stdlib.h>
 
+#include <map>
 #include <set>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
 #include "lufz-configs.h"
@@ -20,6 +23,16 @@ const std::string VERSION = "v0.09";
 const int AGM_INDEX_SHARDS = 2000;
 const int INDEX_SHARDS = 2000;
 const int PHONE_INDEX_SHARDS = 2000;
+// Format version of the exact (unsharded) anagram index, "agmindex".
+const int AGM_EXACT_INDEX_VERSION = 1;
+// Format version of the exact (unsharded) pronunciation index, "phoneindex".
+const int PHONE_EXACT_INDEX_VERSION = 1;
+// Format version of the trie of indexing keys, "indextrie".
+const int INDEX_TRIE_VERSION = 1;
+// Format version of the positional index of long entries, "longindex".
+const int LONG_INDEX_VERSION = 1;
+// Format version of the index of suffix keys of long entries, "suffixindex".
+const int SUFFIX_INDEX_VERSION = 1;
 
 
 struct PhraseInfo {
@@ -65,6 +78,33 @@ struct Lexicon {
   std::map<std::string, std::string> conversions;
 };
 
+/**
+ * Separates command-line arguments into positional args and flags. Flags
+ * look like "--name=value" (or just "--name", which sets the value to
+ * "true") and can appear anywhere. Returns false (after printing an error)
+ * if a flag is not listed in known_flags.
+ */
+bool ParseArgs(int argc, char* argv[],
+               const std::set<std::string>& known_flags,
+               std::vector<std::string>* args,
+               std::map<std::string, std::string>* flags);
+
+/**
+ * Runs f(t) for each t in [0, num_threads), each on its own thread (f(0)
+ * on the calling one).
+ */
+template <typename F>
+void RunOnThreads(int num_threads, F f) {
+  std::vector<std::thread> threads;
+  for (int t = 1; t < num_threads; ++t) {
+    threads.push_back(std::thread(f, t));
+  }
+  f(0);
+  for (std::thread& t : threads) {
+    t.join();
+  }
+}
+
 class LufzUtil {
  public:
   /**
@@ -178,6 +218,18 @@ class LufzUtil {
     return Join(LetterizedPrunedPartsOf(s));
   }
 
+  /**
+   * Returns the same result as StrLetterizedPrunedPartsOf(), but is much
+   * faster on long texts (such as corpus lines) that repeat words: each
+   * space-separated token is normalized separately and memoized in *cache.
+   * Falls back to StrLetterizedPrunedPartsOf() for configs where
+   * tokens cannot be normalized independently (e.g., if a conversion
+   * involves a space).
+   */
+  std::string StrLetterizedPrunedPartsOfText(
+      const std::string& s,
+      std::unordered_map<std::string, std::string>* cache);
+
   /**
    * Returns the joined output of LettersOf().
    */
@@ -248,6 +300,10 @@ class LufzUtil {
   std::string script_;
   std::vector<std::string> letters_;
   std::map<std::string, int> letter_indices_;
+  /**
+   * Whether StrLetterizedPrunedPartsOfText() can work token by token.
+   */
+  bool tokenwise_ok_;
 };
 
 }  // namespace lufz
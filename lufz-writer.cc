@@ -0,0 +1,119 @@
+#include <stdint.h>
+#include <stdio.h>
+
+#include <string.h>
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "lufz-writer.h"
+
+namespace lufz {
+
+OutputWriter::OutputWriter(FILE* fp) : fp_(fp), gzip_(nullptr),
+                                       num_flushed_(0), failed_(false) {
+  if (fp_) {
+    buffer_.reserve(FLUSH_SIZE + (FLUSH_SIZE >> 2));
+  }
+}
+
+OutputWriter::~OutputWriter() {
+  Flush();
+}
+
+bool OutputWriter::DecodeVlq(std::string_view s,
+                             std::vector<int64_t>* values) {
+  values->clear();
+  int64_t last = 0;
+  uint64_t delta = 0;
+  int shift = 0;
+  for (char c : s) {
+    const char* digit = c ? strchr(VLQ_DIGITS, c) : nullptr;
+    if (!digit || shift > 60) {
+      return false;
+    }
+    const uint64_t v = digit - VLQ_DIGITS;
+    delta |= (v & 31) << shift;
+    if (v & 32) {
+      shift += 5;
+    } else {
+      last += delta;
+      values->push_back(last);
+      delta = 0;
+      shift = 0;
+    }
+  }
+  return shift == 0;
+}
+
+std::string OutputWriter::EscapeJson(std::string_view s, bool in_template) {
+  bool plain = true;
+  for (char c : s) {
+    if (c == '"' || c == '\\' || (unsigned char)c < 0x20 ||
+        (in_template && (c == '`' || c == '$'))) {
+      plain = false;
+      break;
+    }
+  }
+  if (plain) {
+    return std::string(s);
+  }
+  // In a template literal, "\\" becomes "\", and then JSON.parse() sees
+  // the usual JSON escapes.
+  const std::string backslash = in_template ? "\\\\" : "\\";
+  std::string escaped;
+  for (char c : s) {
+    if (c == '"') {
+      escaped += backslash;
+      escaped += c;
+    } else if (c == '\\') {
+      escaped += backslash;
+      escaped += backslash;
+    } else if (in_template && (c == '`' || c == '$')) {
+      escaped += '\\';
+      escaped += c;
+    } else if ((unsigned char)c < 0x20) {
+      char hex[8];
+      snprintf(hex, sizeof(hex), "u%04x", (unsigned char)c);
+      escaped += backslash;
+      escaped += hex;
+    } else {
+      escaped += c;
+    }
+  }
+  return escaped;
+}
+
+bool OutputWriter::Flush() {
+  if (fp_ && !buffer_.empty()) {
+    if (gzip_) {
+      gzip_->Write(buffer_);
+    }
+    if (fwrite(buffer_.data(), 1, buffer_.size(), fp_) != buffer_.size()) {
+      if (!failed_) {
+        fprintf(stderr, "Error writing output\n");
+      }
+      failed_ = true;
+    }
+    num_flushed_ += buffer_.size();
+    buffer_.clear();
+  }
+  return !failed_;
+}
+
+void OutputWriter::WriteThrough(std::string_view s) {
+  if (!Flush()) {
+    return;
+  }
+  if (gzip_) {
+    gzip_->Write(s);
+  }
+  if (fwrite(s.data(), 1, s.size(), fp_) != s.size()) {
+    fprintf(stderr, "Error writing output\n");
+    failed_ = true;
+  }
+  num_flushed_ += s.size();
+}
+
+}  // namespace lufz
@@ -0,0 +1,143 @@
+#ifndef LUFZ_WRITER_H_
+#define LUFZ_WRITER_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <charconv>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "lufz-gzip.h"
+
+namespace lufz {
+
+/**
+ * Buffered output, for writing large amounts of text made up of many
+ * small pieces (such as the numbers in index-word-list's output) without
+ * a stdio call per piece. With a FILE*, the buffer is written out whenever
+ * it grows beyond FLUSH_SIZE (and also compressed, with SetGzip()).
+ * Without one, everything is kept in memory (see Contents()), so that
+ * parts of an output can be built separately, possibly in parallel, and
+ * then written out in order.
+ */
+class OutputWriter {
+ public:
+  static const size_t FLUSH_SIZE = 4 << 20;
+  static constexpr char VLQ_DIGITS[] =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+  explicit OutputWriter(FILE* fp = nullptr);
+  // Flushes.
+  ~OutputWriter();
+
+  /**
+   * Also writes everything (as it is flushed) through gzip, which must
+   * outlive this OutputWriter.
+   */
+  void SetGzip(GzipWriter* gzip) {
+    gzip_ = gzip;
+  }
+
+  void Append(std::string_view s) {
+    if (fp_ && s.size() >= FLUSH_SIZE) {
+      WriteThrough(s);
+      return;
+    }
+    buffer_.append(s.data(), s.size());
+    MaybeFlush();
+  }
+  void Append(char c) {
+    buffer_ += c;
+    MaybeFlush();
+  }
+  void AppendInt(int64_t value) {
+    char digits[24];
+    const char* end = std::to_chars(digits, digits + sizeof(digits),
+                                    value).ptr;
+    buffer_.append(digits, end - digits);
+    MaybeFlush();
+  }
+
+  /**
+   * Appends a sorted list of non-negative integers as base64 digits: the
+   * first one and then the difference of each one from the previous one,
+   * each as a variable-length quantity of digits holding 5 bits each (least
+   * significant first), with 32 added to all but the last digit.
+   */
+  template <typename Iter>
+  void AppendVlq(Iter begin, Iter end) {
+    int64_t last = 0;
+    for (Iter it = begin; it != end; ++it) {
+      uint64_t delta = *it - last;
+      last = *it;
+      while (delta >= 32) {
+        buffer_ += VLQ_DIGITS[32 | (delta & 31)];
+        delta >>= 5;
+      }
+      buffer_ += VLQ_DIGITS[delta];
+    }
+    MaybeFlush();
+  }
+
+  /**
+   * Decodes what AppendVlq() appended, into *values. Returns false if s
+   * has a character that is not a base64 digit, or ends in the middle of
+   * a value.
+   */
+  static bool DecodeVlq(std::string_view s, std::vector<int64_t>* values);
+
+  /**
+   * Returns s escaped for use as the contents of a JSON string (with the
+   * extra escaping needed inside a template literal, if in_template).
+   */
+  static std::string EscapeJson(std::string_view s, bool in_template = false);
+
+  /**
+   * Writes out the buffer, if there is a FILE*. Returns false if there
+   * have been any write errors.
+   */
+  bool Flush();
+
+  /**
+   * What has been appended and not yet flushed (everything, if there is no
+   * FILE*).
+   */
+  const std::string& Contents() const {
+    return buffer_;
+  }
+
+  /**
+   * The number of bytes appended so far, including those flushed.
+   */
+  int64_t NumBytes() const {
+    return num_flushed_ + buffer_.size();
+  }
+
+  bool Failed() const {
+    return failed_;
+  }
+
+ private:
+  /**
+   * Flushes, and then writes s directly, without copying it into the
+   * buffer.
+   */
+  void WriteThrough(std::string_view s);
+  void MaybeFlush() {
+    if (fp_ && buffer_.size() >= FLUSH_SIZE) {
+      Flush();
+    }
+  }
+
+  FILE* fp_;
+  GzipWriter* gzip_;
+  std::string buffer_;
+  int64_t num_flushed_;
+  bool failed_;
+};
+
+}  // namespace lufz
+
+#endif  // LUFZ_WRITER_H_
@@ -0,0 +1,86 @@
+#include <map>
+#include <string>
+#include <vector>
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "lufz-counts.h"
+#include "lufz-util.h"
+
+using namespace std;
+using namespace lufz;
+
+/**
+ * Sums up count shards written by add-wiki-popularity --shard_out (over
+ * different byte ranges of a corpus, or over different corpora) and prints
+ * the importance TSV, just like add-wiki-popularity does after a single run.
+ */
+int main(int argc, char* argv[]) {
+  vector<string> args;
+  map<string, string> flags;
+  if (!ParseArgs(argc, argv, {"doc_freq"}, &args, &flags) || args.size() < 3) {
+    fprintf(stderr, "Usage: %s <Language> <lexicon-file> <shard-file>... "
+                    "[--doc_freq=<file>]\n", argv[0]);
+    fprintf(stderr, "  With --doc_freq, an importance TSV based on the "
+                    "summed document\n  frequencies is also written to "
+                    "<file>.\n");
+    return 1;
+  }
+  LufzUtil lufz_util(args[0]);
+
+  Lexicon lexicon;
+  if (!lufz_util.ReadLexicon(args[1].c_str(), &lexicon)) {
+    return 1;
+  }
+  const uint64_t fingerprint = LexiconFingerprint(lexicon);
+
+  PopularityCounts total;
+  total.fingerprint = fingerprint;
+  total.counts.resize(lexicon.phrase_infos.size());
+  const string doc_freq_file = flags["doc_freq"];
+  for (size_t i = 2; i < args.size(); ++i) {
+    const char* shard_file = args[i].c_str();
+    PopularityCounts shard;
+    if (!ReadPopularityCounts(shard_file, &shard)) {
+      return 1;
+    }
+    if (shard.fingerprint != fingerprint ||
+        shard.counts.size() != lexicon.phrase_infos.size() ||
+        !AddPopularityCounts(shard, &total)) {
+      fprintf(stderr, "Shard %s is for a different lexicon\n", shard_file);
+      return 1;
+    }
+    if (!doc_freq_file.empty() &&
+        shard.doc_counts.size() != lexicon.phrase_infos.size()) {
+      fprintf(stderr, "Shard %s does not have document frequencies\n",
+              shard_file);
+      return 1;
+    }
+    fprintf(stderr, "Added shard %s: %" PRId64 " lines (%" PRId64
+                    " doc lines), #probes: %" PRId64 " #hits: %" PRId64 "\n",
+            shard_file, shard.num_lines, shard.num_doc_lines,
+            shard.num_probes, shard.num_hits);
+  }
+  fprintf(stderr, "Total: %" PRId64 " lines (%" PRId64 " doc lines), "
+                  "#probes: %" PRId64 " #hits: %" PRId64 "\n",
+          total.num_lines, total.num_doc_lines,
+          total.num_probes, total.num_hits);
+
+  if (!doc_freq_file.empty()) {
+    Lexicon doc_freq_lexicon = lexicon;
+    ApplyPopularityCounts(total, &doc_freq_lexicon, true);
+    FILE* dfp = fopen(doc_freq_file.c_str(), "w");
+    if (!dfp) {
+      fprintf(stderr, "Could not open %s\n", doc_freq_file.c_str());
+      return 1;
+    }
+    PrintImportances(&doc_freq_lexicon, dfp);
+    fclose(dfp);
+  }
+
+  ApplyPopularityCounts(total, &lexicon);
+  PrintImportances(&lexicon, stdout);
+  return 0;
+}